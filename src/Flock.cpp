@@ -0,0 +1,445 @@
+#include "plugin.hpp"
+#include "notes.hpp"
+
+struct Flock : Module
+{
+	enum ParamIds
+	{
+		NUM_PARAMS
+	};
+	enum InputIds
+	{
+		ENUMS(GATE_INPUT, STALL_NOTES),
+		ENUMS(BUS_INPUT, 3),
+		NUM_INPUTS
+	};
+	enum OutputIds
+	{
+		CV_OUTPUT,
+		GATE_OUTPUT,
+		NUM_OUTPUTS
+	};
+	enum LightIds
+	{
+		ENUMS(GATE_LIGHT, STALL_NOTES),
+		NUM_LIGHTS
+	};
+
+	static const int MAX_VOICES = 16;
+
+	enum StealPolicies
+	{
+		/** The voice that started first */
+		STEAL_OLDEST,
+		/** The voice that started last */
+		STEAL_NEWEST,
+		/** The voice playing the lowest note */
+		STEAL_LOWEST,
+		/** The voice playing the highest note */
+		STEAL_HIGHEST,
+		/** New notes stay silent while all voices play */
+		STEAL_NONE,
+		NUM_STEAL_POLICIES
+	};
+
+	int polyphony = 8;
+	int stealPolicy = STEAL_OLDEST;
+
+	/** Bit i is set while gate i is high, it opens at 1V and closes at 0.1V */
+	uint64_t heldNotes = 0;
+	/** Bit i is set while note i plays on a voice */
+	uint64_t voicedNotes = 0;
+	/** Voice of each note and note of each voice, -1 for none */
+	int noteVoice[STALL_NOTES];
+	int voiceNote[MAX_VOICES];
+	/** Playing voices from the oldest to the newest, linked through the voice numbers, -1 ends the list */
+	int olderVoice[MAX_VOICES];
+	int newerVoice[MAX_VOICES];
+	int oldestVoice = -1;
+	int newestVoice = -1;
+	/** Ring of free voices, a released voice queues up at the back so its release can ring out */
+	int freeVoices[MAX_VOICES];
+	int freeStart = 0;
+	int freeCount = 0;
+	float voiceCv[MAX_VOICES] = {};
+	/** Bit v is set while voice v plays */
+	uint32_t voiceGates = 0;
+	/** Stolen voices, their gate drops for one sample so envelopes start again */
+	uint32_t retriggerVoices = 0;
+	bool isOutputChanged = true;
+	/** voicedNotes for FlockWidget::step() */
+	std::atomic<uint64_t> lightState{0};
+
+	struct Command
+	{
+		enum Type
+		{
+			SET_POLYPHONY,
+			SET_STEAL_POLICY
+		};
+		Type type;
+		int value;
+	};
+	CommandQueue<Command, 8> commands;
+
+	Flock()
+	{
+		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		for (int i = 0; i < STALL_NOTES; i++)
+		{
+			configInput(GATE_INPUT + i, string::f("MIDI note %d", 35 + i));
+		}
+		for (int i = 0; i < 3; i++)
+		{
+			configInput(BUS_INPUT + i, string::f("MIDI notes %d-%d (poly, one channel per note)", 35 + 16 * i, 50 + 16 * i));
+		}
+		configOutput(CV_OUTPUT, "1V/oct (poly)");
+		configOutput(GATE_OUTPUT, "Gate (poly)");
+
+		resetVoices();
+	}
+
+	/** For menus, false if the engine has not caught up and the edit was dropped */
+	bool pushCommand(Command::Type type, int value)
+	{
+		if (!commands.push({type, value}))
+		{
+			WARN("Flock: command queue full, edit dropped");
+			return false;
+		}
+		return true;
+	}
+
+	void applyCommand(const Command &command)
+	{
+		switch (command.type)
+		{
+		case Command::SET_POLYPHONY:
+			polyphony = clamp(command.value, 1, MAX_VOICES);
+			resetVoices();
+			break;
+		case Command::SET_STEAL_POLICY:
+			stealPolicy = clamp(command.value, 0, NUM_STEAL_POLICIES - 1);
+			break;
+		}
+	}
+
+	void onReset() override
+	{
+		applyCommand({Command::SET_POLYPHONY, 8});
+		applyCommand({Command::SET_STEAL_POLICY, STEAL_OLDEST});
+	}
+
+	json_t *dataToJson() override
+	{
+		json_t *rootJ = json_object();
+		json_object_set_new(rootJ, "polyphony", json_integer(polyphony));
+		json_object_set_new(rootJ, "stealPolicy", json_integer(stealPolicy));
+		return rootJ;
+	}
+
+	void dataFromJson(json_t *rootJ) override
+	{
+		json_t *polyphonyJ = json_object_get(rootJ, "polyphony");
+		if (polyphonyJ)
+			applyCommand({Command::SET_POLYPHONY, (int)json_integer_value(polyphonyJ)});
+
+		json_t *stealPolicyJ = json_object_get(rootJ, "stealPolicy");
+		if (stealPolicyJ)
+			applyCommand({Command::SET_STEAL_POLICY, (int)json_integer_value(stealPolicyJ)});
+	}
+
+	/** Frees all voices, notes that are still held get new voices on the next sample */
+	void resetVoices()
+	{
+		for (int i = 0; i < STALL_NOTES; i++)
+		{
+			noteVoice[i] = -1;
+		}
+		for (int v = 0; v < MAX_VOICES; v++)
+		{
+			voiceNote[v] = -1;
+			freeVoices[v] = v;
+		}
+		freeStart = 0;
+		freeCount = polyphony;
+		oldestVoice = newestVoice = -1;
+		heldNotes = voicedNotes = 0;
+		voiceGates = retriggerVoices = 0;
+		isOutputChanged = true;
+	}
+
+	void unlinkVoice(int voice)
+	{
+		if (olderVoice[voice] >= 0)
+			newerVoice[olderVoice[voice]] = newerVoice[voice];
+		else
+			oldestVoice = newerVoice[voice];
+
+		if (newerVoice[voice] >= 0)
+			olderVoice[newerVoice[voice]] = olderVoice[voice];
+		else
+			newestVoice = olderVoice[voice];
+	}
+
+	/** Takes the voice away from its note, the voice's CV stays for the release */
+	void releaseVoice(int voice)
+	{
+		int note = voiceNote[voice];
+		noteVoice[note] = -1;
+		voicedNotes &= ~((uint64_t)1 << note);
+		voiceNote[voice] = -1;
+		voiceGates &= ~(1u << voice);
+		unlinkVoice(voice);
+	}
+
+	/** The voice a new note takes over when none is free, -1 if it stays silent */
+	int findStolenVoice()
+	{
+		switch (stealPolicy)
+		{
+		case STEAL_OLDEST:
+			return oldestVoice;
+		case STEAL_NEWEST:
+			return newestVoice;
+		case STEAL_LOWEST:
+			return noteVoice[__builtin_ctzll(voicedNotes)];
+		case STEAL_HIGHEST:
+			return noteVoice[63 - __builtin_clzll(voicedNotes)];
+		default:
+			return -1;
+		}
+	}
+
+	void noteOn(int note)
+	{
+		int voice;
+		if (freeCount > 0)
+		{
+			voice = freeVoices[freeStart];
+			freeStart = (freeStart + 1) % MAX_VOICES;
+			freeCount--;
+		}
+		else
+		{
+			voice = findStolenVoice();
+			if (voice < 0)
+			{
+				return;
+			}
+			releaseVoice(voice);
+			retriggerVoices |= 1u << voice;
+		}
+
+		voiceNote[voice] = note;
+		noteVoice[note] = voice;
+		voicedNotes |= (uint64_t)1 << note;
+		voiceCv[voice] = getStallNoteCv(note);
+		voiceGates |= 1u << voice;
+
+		// Newest voice at the end of the list
+		olderVoice[voice] = newestVoice;
+		newerVoice[voice] = -1;
+		if (newestVoice >= 0)
+			newerVoice[newestVoice] = voice;
+		else
+			oldestVoice = voice;
+		newestVoice = voice;
+	}
+
+	void noteOff(int note)
+	{
+		int voice = noteVoice[note];
+		if (voice < 0)
+		{
+			// Dropped or stolen before
+			return;
+		}
+		releaseVoice(voice);
+		freeVoices[(freeStart + freeCount) % MAX_VOICES] = voice;
+		freeCount++;
+	}
+
+	void process(const ProcessArgs &args) override
+	{
+		GS_PROFILE_PROCESS("Flock");
+
+		Command command;
+		while (commands.pop(command))
+		{
+			applyCommand(command);
+		}
+
+		// A bus channel adds to the jack of the same note
+		float voltages[STALL_NOTES];
+		for (int i = 0; i < STALL_NOTES; i++)
+		{
+			voltages[i] = inputs[GATE_INPUT + i].getVoltage();
+		}
+		for (int b = 0; b < 3; b++)
+		{
+			Input &bus = inputs[BUS_INPUT + b];
+			int channels = bus.getChannels();
+			for (int c = 0; c < channels; c++)
+			{
+				voltages[16 * b + c] = std::max(voltages[16 * b + c], bus.getVoltage(c));
+			}
+		}
+
+		uint64_t highNotes = 0;
+		uint64_t lowNotes = 0;
+		for (int i = 0; i < STALL_NOTES; i += 4)
+		{
+			simd::float_4 noteVoltages = simd::float_4::load(voltages + i);
+			highNotes |= (uint64_t)simd::movemask(noteVoltages >= 1.f) << i;
+			lowNotes |= (uint64_t)simd::movemask(noteVoltages <= 0.1f) << i;
+		}
+		uint64_t held = (heldNotes | highNotes) & ~lowNotes;
+		uint64_t changed = held ^ heldNotes;
+		heldNotes = held;
+
+		// Last sample's retriggers are over
+		if (retriggerVoices)
+		{
+			retriggerVoices = 0;
+			isOutputChanged = true;
+		}
+
+		if (changed)
+		{
+			// Only the notes that changed, releases first so new notes can take their voices
+			for (uint64_t released = changed & ~held; released; released &= released - 1)
+			{
+				noteOff(__builtin_ctzll(released));
+			}
+			for (uint64_t pressed = changed & held; pressed; pressed &= pressed - 1)
+			{
+				noteOn(__builtin_ctzll(pressed));
+			}
+			lightState.store(voicedNotes, std::memory_order_relaxed);
+			isOutputChanged = true;
+		}
+
+		// Rack clears an output's channels when its last cable goes, so a new cable needs them again
+		bool isOutputStale = outputs[CV_OUTPUT].getChannels() != polyphony || outputs[GATE_OUTPUT].getChannels() != polyphony;
+		if (!isOutputChanged && !isOutputStale)
+		{
+			return;
+		}
+
+		uint32_t gates = voiceGates & ~retriggerVoices;
+		outputs[CV_OUTPUT].setChannels(polyphony);
+		outputs[GATE_OUTPUT].setChannels(polyphony);
+		for (int v = 0; v < polyphony; v++)
+		{
+			outputs[CV_OUTPUT].setVoltage(voiceCv[v], v);
+			outputs[GATE_OUTPUT].setVoltage((gates >> v) & 1 ? 10.f : 0.f, v);
+		}
+		isOutputChanged = false;
+	}
+};
+
+struct FlockWidget : ModuleWidget
+{
+	FlockWidget(Flock *module)
+	{
+		GS_PROFILE_WIDGET("Flock");
+
+		setModule(module);
+		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/Flock.svg")));
+
+		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+		// Stall's grid, so a Flock next to a Stall lines up note by note
+		static const float inGridX[8] = {34.639, 48.165, 61.691, 75.217, 88.743, 102.269, 115.795, 129.321};
+		static const float inGridY[6] = {117.973, 99.375, 80.777, 62.179, 43.581, 24.983};
+		static const float lightGridY[6] = {111.623, 93.025, 74.427, 55.829, 37.231, 18.633};
+
+		for (int y = 0; y < 6; y++)
+		{
+			for (int x = 0; x < 8; x++)
+			{
+				addInput(createInputCentered<PJ301MPort>(mm2px(Vec(inGridX[x], inGridY[y])), module, Flock::GATE_INPUT + x + 8 * y));
+				addChild(createLightCentered<MediumLight<RedLight>>(mm2px(Vec(inGridX[x], lightGridY[y])), module, Flock::GATE_LIGHT + x + 8 * y));
+			}
+		}
+
+		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.586, inGridY[5])), module, Flock::CV_OUTPUT));
+		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.586, inGridY[4])), module, Flock::GATE_OUTPUT));
+		for (int i = 0; i < 3; i++)
+		{
+			addInput(createInputCentered<PJ301MPort>(mm2px(Vec(7.586, inGridY[3 - i])), module, Flock::BUS_INPUT + i));
+		}
+	}
+
+	void step() override
+	{
+		if (module)
+		{
+			uint64_t notes = dynamic_cast<Flock *>(module)->lightState.load(std::memory_order_relaxed);
+			for (int i = 0; i < STALL_NOTES; i++)
+			{
+				module->lights[Flock::GATE_LIGHT + i].value = (notes >> i) & 1;
+			}
+		}
+
+		ModuleWidget::step();
+	}
+
+	void appendContextMenu(Menu *menu) override
+	{
+		Flock *module = dynamic_cast<Flock *>(this->module);
+
+		struct FlockItem : MenuItem
+		{
+			Flock *module;
+			Flock::Command::Type commandType;
+			int value;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(commandType, value);
+			}
+		};
+
+		struct PolyphonyMenuItem : MenuItem
+		{
+			Flock *module;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+				for (int i = 1; i <= Flock::MAX_VOICES; i++)
+				{
+					FlockItem *polyphonyItem = createMenuItem<FlockItem>(string::f("%d", i), CHECKMARK(module->polyphony == i));
+					polyphonyItem->module = module;
+					polyphonyItem->commandType = Flock::Command::SET_POLYPHONY;
+					polyphonyItem->value = i;
+					menu->addChild(polyphonyItem);
+				}
+				return menu;
+			}
+		};
+
+		menu->addChild(new MenuEntry);
+		PolyphonyMenuItem *polyphonyMenuItem = createMenuItem<PolyphonyMenuItem>("Polyphony", string::f("%d ", module->polyphony) + RIGHT_ARROW);
+		polyphonyMenuItem->module = module;
+		menu->addChild(polyphonyMenuItem);
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Voice stealing"));
+
+		static const char *policyNames[Flock::NUM_STEAL_POLICIES] = {"Oldest note", "Newest note", "Lowest note", "Highest note", "Off"};
+		for (int i = 0; i < Flock::NUM_STEAL_POLICIES; i++)
+		{
+			FlockItem *policyItem = createMenuItem<FlockItem>(policyNames[i], CHECKMARK(module->stealPolicy == i));
+			policyItem->module = module;
+			policyItem->commandType = Flock::Command::SET_STEAL_POLICY;
+			policyItem->value = i;
+			menu->addChild(policyItem);
+		}
+	}
+};
+
+Model *modelFlock = createModel<Flock, FlockWidget>("Flock");
@@ -34,12 +34,20 @@ struct Hurdle : Module
 
 void Hurdle::process(const ProcessArgs &args)
 {
-	float probability = inputs[PROBABILITY_INPUT].getVoltage();
-	probability = clamp(probability, 0.0f, 10.0f);
+	GS_PROFILE_PROCESS("Hurdle");
 
 	float gateInValue = inputs[GATE_INPUT].getVoltage();
 	bool gateInIsHigh = gateInValue >= 1.0f;
 
+	// Nothing changes until the gate input crosses the threshold, the output keeps its voltage
+	if (gateInIsHigh == lastGateInWasHigh)
+	{
+		return;
+	}
+
+	float probability = inputs[PROBABILITY_INPUT].getVoltage();
+	probability = clamp(probability, 0.0f, 10.0f);
+
 	if (isOpen)
 	{
 		// Gate is open
@@ -83,6 +91,8 @@ struct HurdleWidget : ModuleWidget
 {
 	HurdleWidget(Hurdle *module)
 	{
+		GS_PROFILE_WIDGET("Hurdle");
+
 		setModule(module);
 		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/Hurdle.svg")));
 
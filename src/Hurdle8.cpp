@@ -0,0 +1,405 @@
+#include "plugin.hpp"
+#include "aliastable.hpp"
+
+/** Weight change that rebuilds the router table, 1% of the 0-10V range */
+static const float ROUTER_THRESHOLD = 0.01f;
+
+struct Hurdle8 : Module
+{
+	enum ParamIds
+	{
+		ENUMS(OFFSET_PARAM, 8),
+		NUM_PARAMS
+	};
+	enum InputIds
+	{
+		ENUMS(PROBABILITY_INPUT, 8),
+		ENUMS(GATE_INPUT, 8),
+		NUM_INPUTS
+	};
+	enum OutputIds
+	{
+		ENUMS(GATE_OUTPUT, 8),
+		NUM_OUTPUTS
+	};
+	enum LightIds
+	{
+		ENUMS(GATE_LIGHT, 8),
+		NUM_LIGHTS
+	};
+
+	enum Modes
+	{
+		MODE_INDEPENDENT,
+		MODE_CORRELATED,
+		MODE_EXCLUSIVE,
+		/** Lane 1's gate goes to exactly one lane, drawn by weight */
+		MODE_ROUTER,
+		NUM_MODES
+	};
+
+	int mode = MODE_INDEPENDENT;
+	/** Exclusive mode: at most this many lanes open on the same edge */
+	int maxLanes = 1;
+	/** Router mode: the gate goes to one of the first routerLanes lanes */
+	int routerLanes = 8;
+	/** Weights the router table was built from, the table is only rebuilt when they moved */
+	float routerWeights[8] = {};
+	bool isRouterChanged = true;
+	AliasTable<8> routerTable;
+
+	/** Bit i is lane i */
+	int openLanes = 0;
+	int lastHighLanes = 0;
+	/** openLanes for Hurdle8Widget::step() */
+	std::atomic<int> lightState{0};
+
+	struct Command
+	{
+		enum Type
+		{
+			SET_MODE,
+			SET_MAX_LANES,
+			SET_ROUTER_LANES
+		};
+		Type type;
+		int value;
+	};
+	CommandQueue<Command, 16> commands;
+
+	Hurdle8()
+	{
+		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		for (int i = 0; i < 8; i++)
+		{
+			configParam(Hurdle8::OFFSET_PARAM + i, -50.f, 50.f, 0.f, string::f("Lane %d offset", i + 1), "%");
+			configInput(Hurdle8::PROBABILITY_INPUT + i, string::f("Lane %d probability", i + 1));
+			configInput(Hurdle8::GATE_INPUT + i, string::f("Lane %d gate", i + 1));
+			configOutput(Hurdle8::GATE_OUTPUT + i, string::f("Lane %d gate", i + 1));
+		}
+	}
+
+	/** For menus and widgets, false if the engine has not caught up and the edit was dropped */
+	bool pushCommand(Command::Type type, int value)
+	{
+		if (!commands.push({type, value}))
+		{
+			WARN("Hurdle8: command queue full, edit dropped");
+			return false;
+		}
+		return true;
+	}
+
+	void applyCommand(const Command &command)
+	{
+		switch (command.type)
+		{
+		case Command::SET_MODE:
+			mode = clamp(command.value, 0, NUM_MODES - 1);
+			break;
+		case Command::SET_MAX_LANES:
+			maxLanes = clamp(command.value, 1, 8);
+			break;
+		case Command::SET_ROUTER_LANES:
+			routerLanes = clamp(command.value, 2, 8);
+			isRouterChanged = true;
+			break;
+		}
+	}
+
+	void onReset() override
+	{
+		applyCommand({Command::SET_MODE, MODE_INDEPENDENT});
+		applyCommand({Command::SET_MAX_LANES, 1});
+		applyCommand({Command::SET_ROUTER_LANES, 8});
+	}
+
+	json_t *dataToJson() override
+	{
+		json_t *rootJ = json_object();
+		json_object_set_new(rootJ, "mode", json_integer(mode));
+		json_object_set_new(rootJ, "maxLanes", json_integer(maxLanes));
+		json_object_set_new(rootJ, "routerLanes", json_integer(routerLanes));
+		return rootJ;
+	}
+
+	void dataFromJson(json_t *rootJ) override
+	{
+		json_t *modeJ = json_object_get(rootJ, "mode");
+		if (modeJ)
+			applyCommand({Command::SET_MODE, (int)json_integer_value(modeJ)});
+
+		json_t *maxLanesJ = json_object_get(rootJ, "maxLanes");
+		if (maxLanesJ)
+			applyCommand({Command::SET_MAX_LANES, (int)json_integer_value(maxLanesJ)});
+
+		json_t *routerLanesJ = json_object_get(rootJ, "routerLanes");
+		if (routerLanesJ)
+			applyCommand({Command::SET_ROUTER_LANES, (int)json_integer_value(routerLanesJ)});
+	}
+
+	/** Keeps the `maxLanes` candidates that cleared their threshold by the widest margin */
+	int limitLanes(int candidates, const float *margins)
+	{
+		int kept = 0;
+		for (int k = 0; k < maxLanes && candidates; k++)
+		{
+			int best = -1;
+			for (int i = 0; i < 8; i++)
+			{
+				if (((candidates >> i) & 1) && (best < 0 || margins[i] > margins[best]))
+				{
+					best = i;
+				}
+			}
+			kept |= 1 << best;
+			candidates &= ~(1 << best);
+		}
+		return kept;
+	}
+
+	/** The lane for one routed edge, -1 if all weights are 0. Only edges look at the weights, so audio-rate weight CV costs nothing in between. */
+	int routeEdge(const float *weights)
+	{
+		int movedLanes = 0;
+		for (int i = 0; i < 8; i += 4)
+		{
+			simd::float_4 change = simd::fabs(simd::float_4::load(weights + i) - simd::float_4::load(routerWeights + i));
+			movedLanes |= simd::movemask(change > ROUTER_THRESHOLD) << i;
+		}
+
+		if (isRouterChanged || (movedLanes & ((1 << routerLanes) - 1)))
+		{
+			GS_TRACE_ZONE("Hurdle8 build router table");
+			std::memcpy(routerWeights, weights, sizeof(routerWeights));
+			routerTable.build(routerWeights, routerLanes);
+			isRouterChanged = false;
+		}
+
+		return routerTable.size ? routerTable.sample(random::uniform()) : -1;
+	}
+
+	void process(const ProcessArgs &args) override
+	{
+		GS_PROFILE_PROCESS("Hurdle8");
+
+		Command command;
+		while (commands.pop(command))
+		{
+			applyCommand(command);
+		}
+
+		// Unpatched lanes are normalled to the lane above
+		float gates[8];
+		float probabilities[8];
+		float gate = 0.f;
+		float probability = 0.f;
+		for (int i = 0; i < 8; i++)
+		{
+			if (inputs[GATE_INPUT + i].isConnected())
+				gate = inputs[GATE_INPUT + i].getVoltage();
+			if (inputs[PROBABILITY_INPUT + i].isConnected())
+				probability = inputs[PROBABILITY_INPUT + i].getVoltage();
+			gates[i] = gate;
+			probabilities[i] = clamp(probability, 0.0f, 10.0f) * 0.1f;
+		}
+
+		int highLanes = 0;
+		for (int i = 0; i < 8; i += 4)
+		{
+			highLanes |= simd::movemask(simd::float_4::load(gates + i) >= 1.0f) << i;
+		}
+		int risingLanes = highLanes & ~lastHighLanes;
+
+		if (mode == MODE_ROUTER)
+		{
+			// The routed lane stays open until lane 1's gate goes low
+			if (!(highLanes & 1))
+			{
+				openLanes = 0;
+			}
+			else if (risingLanes & 1)
+			{
+				int lane = routeEdge(probabilities);
+				openLanes = lane >= 0 ? 1 << lane : 0;
+			}
+		}
+		else
+		{
+			// Open gates stay open until their input goes low
+			openLanes &= highLanes;
+		}
+
+		if (risingLanes && mode != MODE_ROUTER)
+		{
+			// One batch of draws for all lanes
+			float draws[8];
+			float shared = random::uniform();
+			for (int i = 0; i < 8; i++)
+			{
+				draws[i] = mode == MODE_CORRELATED ? shared + params[OFFSET_PARAM + i].getValue() * 0.01f : random::uniform();
+			}
+
+			int passingLanes = 0;
+			float margins[8];
+			for (int i = 0; i < 8; i += 4)
+			{
+				simd::float_4 margin = simd::float_4::load(probabilities + i) - simd::float_4::load(draws + i);
+				margin.store(margins + i);
+				passingLanes |= simd::movemask(margin >= 0.f) << i;
+			}
+
+			int decidedLanes = passingLanes & risingLanes;
+			if (mode == MODE_EXCLUSIVE)
+			{
+				decidedLanes = limitLanes(decidedLanes, margins);
+			}
+			openLanes |= decidedLanes;
+		}
+
+		lastHighLanes = highLanes;
+
+		for (int i = 0; i < 8; i++)
+		{
+			outputs[GATE_OUTPUT + i].setVoltage(((openLanes >> i) & 1) ? 10.0f : 0.0f);
+		}
+		lightState.store(openLanes, std::memory_order_relaxed);
+	}
+};
+
+struct Hurdle8Widget : ModuleWidget
+{
+	Hurdle8Widget(Hurdle8 *module)
+	{
+		GS_PROFILE_WIDGET("Hurdle8");
+
+		setModule(module);
+		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/Hurdle8.svg")));
+
+		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+		static const float col[5] = {7.0f, 17.5f, 27.5f, 35.5f, 43.8f};
+		static const float row[8] = {18.f, 31.f, 44.f, 57.f, 70.f, 83.f, 96.f, 109.f};
+		for (int i = 0; i < 8; i++)
+		{
+			addInput(createInputCentered<PJ301MPort>(mm2px(Vec(col[0], row[i])), module, Hurdle8::GATE_INPUT + i));
+			addInput(createInputCentered<PJ301MPort>(mm2px(Vec(col[1], row[i])), module, Hurdle8::PROBABILITY_INPUT + i));
+			addParam(createParamCentered<Trimpot>(mm2px(Vec(col[2], row[i])), module, Hurdle8::OFFSET_PARAM + i));
+			addChild(createLightCentered<SmallLight<GreenLight>>(mm2px(Vec(col[3], row[i])), module, Hurdle8::GATE_LIGHT + i));
+			addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(col[4], row[i])), module, Hurdle8::GATE_OUTPUT + i));
+		}
+	}
+
+	void step() override
+	{
+		if (module)
+		{
+			int openLanes = dynamic_cast<Hurdle8 *>(module)->lightState.load(std::memory_order_relaxed);
+			for (int i = 0; i < 8; i++)
+			{
+				module->lights[Hurdle8::GATE_LIGHT + i].value = (openLanes >> i) & 1;
+			}
+		}
+
+		ModuleWidget::step();
+	}
+
+	void appendContextMenu(Menu *menu) override
+	{
+		Hurdle8 *module = dynamic_cast<Hurdle8 *>(this->module);
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Mode"));
+
+		struct ModeItem : MenuItem
+		{
+			Hurdle8 *module;
+			int mode;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(Hurdle8::Command::SET_MODE, mode);
+			}
+		};
+
+		std::string modeNames[Hurdle8::NUM_MODES] = {"Independent", "Correlated", "Exclusive", "Router"};
+		for (int i = 0; i < Hurdle8::NUM_MODES; i++)
+		{
+			ModeItem *modeItem = createMenuItem<ModeItem>(modeNames[i]);
+			modeItem->rightText = CHECKMARK(module->mode == i);
+			modeItem->module = module;
+			modeItem->mode = i;
+			menu->addChild(modeItem);
+		}
+
+		struct MaxLanesItem : MenuItem
+		{
+			Hurdle8 *module;
+			int maxLanes;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(Hurdle8::Command::SET_MAX_LANES, maxLanes);
+			}
+		};
+
+		struct MaxLanesMenuItem : MenuItem
+		{
+			Hurdle8 *module;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+				for (int i = 1; i <= 8; i++)
+				{
+					MaxLanesItem *maxLanesItem = createMenuItem<MaxLanesItem>(string::f("%d", i));
+					maxLanesItem->rightText = CHECKMARK(module->maxLanes == i);
+					maxLanesItem->module = module;
+					maxLanesItem->maxLanes = i;
+					menu->addChild(maxLanesItem);
+				}
+				return menu;
+			}
+		};
+
+		MaxLanesMenuItem *maxLanesMenuItem = createMenuItem<MaxLanesMenuItem>("Max. open lanes per edge", RIGHT_ARROW);
+		maxLanesMenuItem->module = module;
+		maxLanesMenuItem->disabled = module->mode != Hurdle8::MODE_EXCLUSIVE;
+		menu->addChild(maxLanesMenuItem);
+
+		struct RouterLanesItem : MenuItem
+		{
+			Hurdle8 *module;
+			int routerLanes;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(Hurdle8::Command::SET_ROUTER_LANES, routerLanes);
+			}
+		};
+
+		struct RouterLanesMenuItem : MenuItem
+		{
+			Hurdle8 *module;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+				for (int i = 2; i <= 8; i++)
+				{
+					RouterLanesItem *routerLanesItem = createMenuItem<RouterLanesItem>(string::f("%d", i));
+					routerLanesItem->rightText = CHECKMARK(module->routerLanes == i);
+					routerLanesItem->module = module;
+					routerLanesItem->routerLanes = i;
+					menu->addChild(routerLanesItem);
+				}
+				return menu;
+			}
+		};
+
+		RouterLanesMenuItem *routerLanesMenuItem = createMenuItem<RouterLanesMenuItem>("Router lanes", RIGHT_ARROW);
+		routerLanesMenuItem->module = module;
+		routerLanesMenuItem->disabled = module->mode != Hurdle8::MODE_ROUTER;
+		menu->addChild(routerLanesMenuItem);
+	}
+};
+
+Model *modelHurdle8 = createModel<Hurdle8, Hurdle8Widget>("Hurdle8");
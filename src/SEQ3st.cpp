@@ -1,4 +1,16 @@
 #include "plugin.hpp"
+#include "patternmenu.hpp"
+#include "syncgroup.hpp"
+#include "transport.hpp"
+
+/** Scales of the row quantizer, bit i is the semitone i above the root */
+static const int NUM_SCALES = 10;
+static const uint16_t scaleMasks[NUM_SCALES] = {0x000, 0xfff, 0xab5, 0x5ad, 0x9ad, 0x6ad, 0x6b5, 0x295, 0x4a9, 0x4e9};
+static const char *scaleNames[NUM_SCALES] = {"Off", "Chromatic", "Major", "Minor", "Harmonic minor", "Dorian", "Mixolydian", "Major pentatonic", "Minor pentatonic", "Blues"};
+static const char *noteNames[12] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+static const int NUM_RANGES = 6;
+/** Octaves the 0-10V knob range is spread over */
+static const int rangeOctaves[NUM_RANGES] = {1, 2, 3, 4, 5, 10};
 
 struct SEQ3st : Module
 {
@@ -49,6 +61,12 @@ struct SEQ3st : Module
 		NUM_LIGHTS
 	};
 
+	static const int MAX_STEPS = 64;
+	static const int PAGE_STEPS = 8;
+	static const int MAX_DIVISION = 16;
+	/** Quantizer table entries, half a semitone apart over the widest range */
+	static const int QUANTIZER_TABLE_SIZE = 10 * 24 + 1;
+
 	bool running = true;
 	dsp::SchmittTrigger clockTrigger;
 	dsp::SchmittTrigger runningTrigger;
@@ -57,19 +75,112 @@ struct SEQ3st : Module
 	/** Phase of internal LFO */
 	float phase = 0.f;
 	int index = 0;
-	bool gates[8] = {};
-	bool gateRow1IsOpen = false;
-	bool gateRow2IsOpen = false;
-	bool gateRow3IsOpen = false;
+	/** Step values per row, the knobs edit one page of eight steps */
+	float rowValues[3][MAX_STEPS] = {};
+	bool gates[MAX_STEPS];
+	int page = 0;
+	bool pageFollowsIndex = false;
+	bool gateRowIsOpen[3] = {};
+
+	/** Master clock steps since the last reset */
+	uint32_t tick = 0;
+	/** Polymeter per row: steps (0 follows the Steps knob), master steps per row step, first step */
+	int rowLength[3] = {};
+	int rowDivision[3] = {1, 1, 1};
+	int rowOffset[3] = {};
+	/** Steps the row played since the reset, wrapped at its length */
+	int rowPosition[3] = {};
+	/** Step each row plays, only moves when the row's divided clock fires */
+	int rowStep[3] = {};
+
+	/** The knobs are polled every 16 samples, 0.4 ms at 44.1 kHz, which no knob gesture outruns */
+	dsp::ClockDivider knobDivider;
+	/** Clock and reset from a Seqtrol on the left */
+	TransportReceiver transportReceiver;
+	/** Clock and reset from the leader of a sync group */
+	SyncLink syncLink;
+
+	/** Quantizer settings per row, scale 0 is off */
+	int quantizerScale[3] = {};
+	int quantizerRoot[3] = {};
+	int quantizerRange[3] = {NUM_RANGES - 1, NUM_RANGES - 1, NUM_RANGES - 1};
+	bool isQuantizerChanged = true;
+	/** Nearest scale note in volts for every half semitone of the row's range */
+	float quantizerTable[3][QUANTIZER_TABLE_SIZE];
+	simd::float_4 quantizerIndexPerVolt = 0.f;
+	simd::float_4 quantizerLastIndex = 0.f;
+	simd::float_4 quantizerEnabled = 0.f;
+	/** Pattern library browsing from the menu */
+	int libraryTag = -1;
+	int libraryPattern = -1;
+	const PatternLibrary *lastLibrary = nullptr;
+
+	/** What the panel shows, SEQ3stWidget::step() derives the lights from it */
+	struct LightState
+	{
+		/** Gates of the page on the buttons, bit i is button i */
+		uint8_t pageGates;
+		/** Playhead relative to the page on the buttons */
+		int pageIndex;
+		float rowValues[3];
+		/** Bit r is set if gate row r was open since the last snapshot */
+		uint8_t rowGates;
+		bool running;
+		bool reset;
+		bool gate;
+	};
+	LightState lightState = {};
+	Snapshot<LightState> lightSnapshot;
 	dsp::ClockDivider lightDivider;
 
+	/** The steps for saving to the pattern library from the menu */
+	struct PatternState
+	{
+		int steps;
+		uint64_t gates;
+		float rowValues[3][MAX_STEPS];
+	};
+	Snapshot<PatternState> patternSnapshot;
+	dsp::ClockDivider patternDivider;
+
+	struct Command
+	{
+		enum Type
+		{
+			RESET,
+			SET_RUNNING,
+			SET_GATES,
+			SET_VALUE,
+			SET_PAGE,
+			SET_PAGE_FOLLOWS_INDEX,
+			/** step is the entry, bits the PatternLibrary it is in */
+			LOAD_PATTERN,
+			SET_QUANTIZER_SCALE,
+			SET_QUANTIZER_ROOT,
+			SET_QUANTIZER_RANGE,
+			SET_ROW_LENGTH,
+			SET_ROW_DIVISION,
+			SET_ROW_OFFSET,
+			/** step is the group, -1 for none, bits is 1 to lead it */
+			SET_SYNC_GROUP
+		};
+		Type type;
+		int row;
+		int step;
+		float value;
+		/** For SET_GATES bit i is gate i */
+		uint64_t bits;
+	};
+	CommandQueue<Command, 16> commands;
+
 	SEQ3st()
 	{
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		transportReceiver.attach(this);
 		configParam(SEQ3st::CLOCK_PARAM, -2.0f, 6.0f, 2.0f, "Clock");
 		configParam(SEQ3st::RUN_PARAM, 0.0f, 1.0f, 0.0f, "Run");
 		configParam(SEQ3st::RESET_PARAM, 0.0f, 1.0f, 0.0f, "Reset");
-		configParam(SEQ3st::STEPS_PARAM, 1.0f, 8.0f, 8.0f, "Steps");
+		configParam(SEQ3st::STEPS_PARAM, 1.0f, (float)MAX_STEPS, 8.0f, "Steps");
 		configParam(SEQ3st::SHAPE_PARAM, -5.f, 5.f, 0.f, "Shape");
 		for (int i = 0; i < 8; i++)
 		{
@@ -79,23 +190,291 @@ struct SEQ3st : Module
 			configParam(SEQ3st::GATE_PARAM + i, 0.0f, 1.0f, 0.0f, "Gate");
 		}
 
-		onReset();
+		for (int i = 0; i < MAX_STEPS; i++)
+		{
+			gates[i] = true;
+		}
+		knobDivider.setDivision(16);
+		lightDivider.setDivision(32);
+		patternDivider.setDivision(512);
+		publishPattern();
 	}
 
-	void onReset() override
+	/** For menus and widgets, false if the engine has not caught up and the edit was dropped */
+	bool pushCommand(Command::Type type, int row = 0, int step = 0, float value = 0.f, uint64_t bits = 0)
 	{
-		for (int i = 0; i < 8; i++)
+		if (!commands.push({type, row, step, value, bits}))
 		{
-			gates[i] = true;
+			WARN("SEQ3st: command queue full, edit dropped");
+			return false;
+		}
+		return true;
+	}
+
+	/** For onReset, onRandomize and dataFromJson, Rack serializes the module right after them */
+	void applyState(Command::Type type, int row = 0, int step = 0, float value = 0.f, uint64_t bits = 0)
+	{
+		applyCommand({type, row, step, value, bits});
+	}
+
+	void applyCommand(const Command &command)
+	{
+		switch (command.type)
+		{
+		case Command::RESET:
+			for (int i = 0; i < MAX_STEPS; i++)
+			{
+				gates[i] = true;
+				rowValues[0][i] = rowValues[1][i] = rowValues[2][i] = 0.f;
+			}
+			for (int row = 0; row < 3; row++)
+			{
+				rowLength[row] = 0;
+				rowDivision[row] = 1;
+				rowOffset[row] = 0;
+			}
+			setPage(0);
+			break;
+		case Command::SET_RUNNING:
+			running = command.bits;
+			break;
+		case Command::SET_GATES:
+			for (int i = 0; i < MAX_STEPS; i++)
+			{
+				gates[i] = (command.bits >> i) & 1;
+			}
+			break;
+		case Command::SET_VALUE:
+			rowValues[clamp(command.row, 0, 2)][clamp(command.step, 0, MAX_STEPS - 1)] = clamp(command.value, 0.f, 10.f);
+			setPage(page);
+			break;
+		case Command::SET_PAGE:
+			flipPage(clamp(command.step / PAGE_STEPS, 0, MAX_STEPS / PAGE_STEPS - 1));
+			break;
+		case Command::SET_PAGE_FOLLOWS_INDEX:
+			pageFollowsIndex = command.bits;
+			break;
+		case Command::LOAD_PATTERN:
+			loadPattern((const PatternLibrary *)(uintptr_t)command.bits, command.step);
+			break;
+		case Command::SET_QUANTIZER_SCALE:
+			quantizerScale[clamp(command.row, 0, 2)] = clamp(command.step, 0, NUM_SCALES - 1);
+			isQuantizerChanged = true;
+			break;
+		case Command::SET_QUANTIZER_ROOT:
+			quantizerRoot[clamp(command.row, 0, 2)] = clamp(command.step, 0, 11);
+			isQuantizerChanged = true;
+			break;
+		case Command::SET_QUANTIZER_RANGE:
+			quantizerRange[clamp(command.row, 0, 2)] = clamp(command.step, 0, NUM_RANGES - 1);
+			isQuantizerChanged = true;
+			break;
+		case Command::SET_ROW_LENGTH:
+			rowLength[clamp(command.row, 0, 2)] = clamp(command.step, 0, MAX_STEPS);
+			break;
+		case Command::SET_ROW_DIVISION:
+			rowDivision[clamp(command.row, 0, 2)] = clamp(command.step, 1, MAX_DIVISION);
+			break;
+		case Command::SET_ROW_OFFSET:
+			rowOffset[clamp(command.row, 0, 2)] = clamp(command.step, 0, MAX_STEPS - 1);
+			break;
+		case Command::SET_SYNC_GROUP:
+			syncLink.join(command.step, command.bits, id);
+			break;
+		}
+	}
+
+	/** Rebuilds the lookup tables of the quantizer, only after its settings changed */
+	void buildQuantizer()
+	{
+		GS_TRACE_ZONE("SEQ3st build quantizer");
+
+		float indexPerVolt[4] = {};
+		float lastIndex[4] = {};
+		float enabled[4] = {};
+		for (int row = 0; row < 3; row++)
+		{
+			uint16_t mask = scaleMasks[quantizerScale[row]];
+			int root = quantizerRoot[row];
+			int size = rangeOctaves[quantizerRange[row]] * 24 + 1;
+			for (int i = 0; i < size; i++)
+			{
+				// Search outwards from the half semitone, the lower note wins a tie
+				int note = i / 2;
+				for (int distance = 0; mask && distance <= 12; distance++)
+				{
+					int below = i / 2 - distance;
+					int above = (i + 1) / 2 + distance;
+					if ((mask >> ((below - root + 120) % 12)) & 1)
+					{
+						note = below;
+						break;
+					}
+					if ((mask >> ((above - root + 120) % 12)) & 1)
+					{
+						note = above;
+						break;
+					}
+				}
+				quantizerTable[row][i] = note / 12.f;
+			}
+			indexPerVolt[row] = (size - 1) / 10.f;
+			lastIndex[row] = size - 1;
+			enabled[row] = mask ? 1.f : 0.f;
+		}
+		quantizerIndexPerVolt = simd::float_4::load(indexPerVolt);
+		quantizerLastIndex = simd::float_4::load(lastIndex);
+		quantizerEnabled = simd::float_4::load(enabled) > 0.f;
+		isQuantizerChanged = false;
+	}
+
+	/** The values of each row's step as V/oct, quantized in one vector. Rows with the quantizer off pass through. */
+	simd::float_4 quantizeRows(const int *steps)
+	{
+		simd::float_4 values(rowValues[0][steps[0]], rowValues[1][steps[1]], rowValues[2][steps[2]], 0.f);
+		simd::float_4 indices = simd::clamp(simd::round(values * quantizerIndexPerVolt), 0.f, quantizerLastIndex);
+		float notes[4] = {};
+		for (int row = 0; row < 3; row++)
+		{
+			notes[row] = quantizerTable[row][(int)indices[row]];
+		}
+		return simd::ifelse(quantizerEnabled, simd::float_4::load(notes), values);
+	}
+
+	/** Shows the given page on the knobs */
+	void setPage(int page)
+	{
+		GS_TRACE_ZONE("SEQ3st set page");
+
+		this->page = page;
+		for (int i = 0; i < PAGE_STEPS; i++)
+		{
+			params[ROW1_PARAM + i].setValue(rowValues[0][page * PAGE_STEPS + i]);
+			params[ROW2_PARAM + i].setValue(rowValues[1][page * PAGE_STEPS + i]);
+			params[ROW3_PARAM + i].setValue(rowValues[2][page * PAGE_STEPS + i]);
+		}
+	}
+
+	/** Copies a PATTERN_ROWS entry into the steps and sets the step count to its length */
+	void loadPattern(const PatternLibrary *library, int entry)
+	{
+		if (!library || entry < 0 || entry >= library->getCount() || library->entries[entry].kind != PATTERN_ROWS)
+		{
+			return;
+		}
+
+		GS_TRACE_ZONE("SEQ3st load pattern");
+
+		const PatternRows *pattern = (const PatternRows *)library->getData(entry);
+		const float *values = (const float *)(pattern + 1);
+		int steps = std::min((int)pattern->steps, MAX_STEPS);
+		for (int i = 0; i < MAX_STEPS; i++)
+		{
+			bool isInPattern = i < steps;
+			gates[i] = isInPattern ? (pattern->gates >> i) & 1 : true;
+			for (int row = 0; row < 3; row++)
+			{
+				rowValues[row][i] = isInPattern ? clamp(values[row * pattern->steps + i], 0.f, 10.f) : 0.f;
+			}
+		}
+		params[STEPS_PARAM].setValue(steps);
+		setPage(page);
+
+		lastLibrary = library;
+		libraryPattern = entry;
+	}
+
+	/** Engine thread, every patternDivider samples */
+	void publishPattern()
+	{
+		PatternState state;
+		state.steps = (int)clamp(roundf(params[STEPS_PARAM].getValue()), 1.f, (float)MAX_STEPS);
+		state.gates = 0;
+		for (int i = 0; i < MAX_STEPS; i++)
+		{
+			state.gates |= (uint64_t)gates[i] << i;
+		}
+		std::memcpy(state.rowValues, rowValues, sizeof(rowValues));
+		patternSnapshot.publish(state);
+	}
+
+	/** UI thread, the steps up to the step count as a PATTERN_ROWS record for PatternLibrary::save() */
+	PatternRecord makePatternRecord()
+	{
+		const PatternState &state = patternSnapshot.read();
+		int steps = clamp(state.steps, 1, MAX_STEPS);
+		PatternRows pattern = {};
+		pattern.steps = steps;
+		pattern.gates = state.gates & (steps < 64 ? ((uint64_t)1 << steps) - 1 : ~(uint64_t)0);
+
+		PatternRecord record;
+		record.kind = PATTERN_ROWS;
+		record.data.resize(sizeof(PatternRows) + 3 * steps * sizeof(float));
+		std::memcpy(record.data.data(), &pattern, sizeof(pattern));
+		for (int row = 0; row < 3; row++)
+		{
+			std::memcpy(record.data.data() + sizeof(PatternRows) + row * steps * sizeof(float), state.rowValues[row], steps * sizeof(float));
 		}
+		return record;
+	}
+
+	/** Keeps the knob turns since the last processKnobs() before the knobs show another page */
+	void flipPage(int page)
+	{
+		processKnobs();
+		setPage(page);
+	}
+
+	/** Copies the knobs that no longer match their step into the step values of the current page */
+	void processKnobs()
+	{
+		static const int rowParams[3] = {ROW1_PARAM, ROW2_PARAM, ROW3_PARAM};
+		for (int row = 0; row < 3; row++)
+		{
+			for (int i = 0; i < PAGE_STEPS; i++)
+			{
+				float value = params[rowParams[row] + i].getValue();
+				float &stepValue = rowValues[row][page * PAGE_STEPS + i];
+				if (value != stepValue)
+				{
+					stepValue = value;
+				}
+			}
+		}
+	}
+
+	~SEQ3st()
+	{
+		syncLink.leave(id);
+	}
+
+	void onReset() override
+	{
+		applyState(Command::RESET);
+		applyState(Command::SET_SYNC_GROUP, 0, -1);
 	}
 
 	void onRandomize() override
 	{
-		for (int i = 0; i < 8; i++)
+		uint64_t gateBits = 0;
+		for (int i = 0; i < MAX_STEPS; i++)
 		{
-			gates[i] = (random::uniform() > 0.5f);
+			if (random::uniform() > 0.5f)
+			{
+				gateBits |= (uint64_t)1 << i;
+			}
 		}
+		applyState(Command::SET_GATES, 0, 0, 0.f, gateBits);
+
+		// Rack only randomized the knobs, i.e. the page they show
+		for (int row = 0; row < 3; row++)
+		{
+			for (int i = 0; i < MAX_STEPS; i++)
+			{
+				rowValues[row][i] = random::uniform() * 10.f;
+			}
+		}
+		setPage(page);
 	}
 
 	json_t *dataToJson() override
@@ -107,44 +486,213 @@ struct SEQ3st : Module
 
 		// gates
 		json_t *gatesJ = json_array();
-		for (int i = 0; i < 8; i++)
+		for (int i = 0; i < MAX_STEPS; i++)
 		{
 			json_array_insert_new(gatesJ, i, json_integer((int)gates[i]));
 		}
 		json_object_set_new(rootJ, "gates", gatesJ);
 
+		// step values
+		json_t *rowsJ = json_array();
+		for (int row = 0; row < 3; row++)
+		{
+			json_t *valuesJ = json_array();
+			for (int i = 0; i < MAX_STEPS; i++)
+			{
+				json_array_insert_new(valuesJ, i, json_real(rowValues[row][i]));
+			}
+			json_array_insert_new(rowsJ, row, valuesJ);
+		}
+		json_object_set_new(rootJ, "rows", rowsJ);
+
+		// page
+		json_object_set_new(rootJ, "page", json_integer(page));
+		json_object_set_new(rootJ, "pageFollowsIndex", json_boolean(pageFollowsIndex));
+
+		// quantizer
+		json_t *scalesJ = json_array();
+		json_t *rootsJ = json_array();
+		json_t *rangesJ = json_array();
+		for (int row = 0; row < 3; row++)
+		{
+			json_array_insert_new(scalesJ, row, json_integer(quantizerScale[row]));
+			json_array_insert_new(rootsJ, row, json_integer(quantizerRoot[row]));
+			json_array_insert_new(rangesJ, row, json_integer(quantizerRange[row]));
+		}
+		json_object_set_new(rootJ, "quantizerScales", scalesJ);
+		json_object_set_new(rootJ, "quantizerRoots", rootsJ);
+		json_object_set_new(rootJ, "quantizerRanges", rangesJ);
+
+		// polymeter
+		json_t *lengthsJ = json_array();
+		json_t *divisionsJ = json_array();
+		json_t *offsetsJ = json_array();
+		for (int row = 0; row < 3; row++)
+		{
+			json_array_insert_new(lengthsJ, row, json_integer(rowLength[row]));
+			json_array_insert_new(divisionsJ, row, json_integer(rowDivision[row]));
+			json_array_insert_new(offsetsJ, row, json_integer(rowOffset[row]));
+		}
+		json_object_set_new(rootJ, "rowLengths", lengthsJ);
+		json_object_set_new(rootJ, "rowDivisions", divisionsJ);
+		json_object_set_new(rootJ, "rowOffsets", offsetsJ);
+
+		// sync group
+		json_object_set_new(rootJ, "syncGroup", json_integer(syncLink.group.load()));
+		json_object_set_new(rootJ, "syncLeader", json_boolean(syncLink.isLeader(id)));
+
 		return rootJ;
 	}
 
 	void dataFromJson(json_t *rootJ) override
 	{
+		GS_TRACE_ZONE("SEQ3st dataFromJson");
+
 		// running
 		json_t *runningJ = json_object_get(rootJ, "running");
 		if (runningJ)
-			running = json_is_true(runningJ);
+			applyState(Command::SET_RUNNING, 0, 0, 0.f, json_is_true(runningJ));
 
 		// gates
 		json_t *gatesJ = json_object_get(rootJ, "gates");
 		if (gatesJ)
 		{
-			for (int i = 0; i < 8; i++)
+			uint64_t gateBits = 0;
+			for (int i = 0; i < MAX_STEPS; i++)
 			{
 				json_t *gateJ = json_array_get(gatesJ, i);
-				if (gateJ)
-					gates[i] = !!json_integer_value(gateJ);
+				if (gateJ ? !!json_integer_value(gateJ) : gates[i])
+					gateBits |= (uint64_t)1 << i;
 			}
+			applyState(Command::SET_GATES, 0, 0, 0.f, gateBits);
 		}
+
+		// step values, patches from before paging only have the knobs
+		json_t *rowsJ = json_object_get(rootJ, "rows");
+		if (rowsJ)
+		{
+			for (int row = 0; row < 3; row++)
+			{
+				json_t *valuesJ = json_array_get(rowsJ, row);
+				for (int i = 0; valuesJ && i < MAX_STEPS; i++)
+				{
+					json_t *valueJ = json_array_get(valuesJ, i);
+					if (valueJ)
+						applyState(Command::SET_VALUE, row, i, json_number_value(valueJ));
+				}
+			}
+		}
+		else
+		{
+			// The knobs are the first page
+			page = 0;
+			processKnobs();
+		}
+
+		// page, the knobs already hold the saved one
+		json_t *pageJ = json_object_get(rootJ, "page");
+		if (pageJ)
+			setPage(clamp((int)json_integer_value(pageJ), 0, MAX_STEPS / PAGE_STEPS - 1));
+
+		json_t *pageFollowsIndexJ = json_object_get(rootJ, "pageFollowsIndex");
+		if (pageFollowsIndexJ)
+			applyState(Command::SET_PAGE_FOLLOWS_INDEX, 0, 0, 0.f, json_is_true(pageFollowsIndexJ));
+
+		// quantizer
+		json_t *scalesJ = json_object_get(rootJ, "quantizerScales");
+		json_t *rootsJ = json_object_get(rootJ, "quantizerRoots");
+		json_t *rangesJ = json_object_get(rootJ, "quantizerRanges");
+		for (int row = 0; row < 3; row++)
+		{
+			json_t *scaleJ = json_array_get(scalesJ, row);
+			if (scaleJ)
+				applyState(Command::SET_QUANTIZER_SCALE, row, json_integer_value(scaleJ));
+			json_t *rootNoteJ = json_array_get(rootsJ, row);
+			if (rootNoteJ)
+				applyState(Command::SET_QUANTIZER_ROOT, row, json_integer_value(rootNoteJ));
+			json_t *rangeJ = json_array_get(rangesJ, row);
+			if (rangeJ)
+				applyState(Command::SET_QUANTIZER_RANGE, row, json_integer_value(rangeJ));
+		}
+
+		// polymeter
+		json_t *lengthsJ = json_object_get(rootJ, "rowLengths");
+		json_t *divisionsJ = json_object_get(rootJ, "rowDivisions");
+		json_t *offsetsJ = json_object_get(rootJ, "rowOffsets");
+		for (int row = 0; row < 3; row++)
+		{
+			json_t *lengthJ = json_array_get(lengthsJ, row);
+			if (lengthJ)
+				applyState(Command::SET_ROW_LENGTH, row, json_integer_value(lengthJ));
+			json_t *divisionJ = json_array_get(divisionsJ, row);
+			if (divisionJ)
+				applyState(Command::SET_ROW_DIVISION, row, json_integer_value(divisionJ));
+			json_t *offsetJ = json_array_get(offsetsJ, row);
+			if (offsetJ)
+				applyState(Command::SET_ROW_OFFSET, row, json_integer_value(offsetJ));
+		}
+
+		// sync group
+		json_t *syncGroupJ = json_object_get(rootJ, "syncGroup");
+		if (syncGroupJ)
+			syncLink.restore(json_integer_value(syncGroupJ), json_is_true(json_object_get(rootJ, "syncLeader")), id);
+
+		// A bypassed module never publishes, the menu should still save what was loaded
+		publishPattern();
+	}
+
+	int getNumSteps()
+	{
+		return (int)clamp(roundf(params[STEPS_PARAM].getValue() + inputs[STEPS_INPUT].getVoltage()), 1.0f, (float)MAX_STEPS);
 	}
 
 	void setIndex(int index)
 	{
-		int numSteps = (int)clamp(roundf(params[STEPS_PARAM].getValue() + inputs[STEPS_INPUT].getVoltage()), 1.0f, 8.0f);
+		int numSteps = getNumSteps();
 		phase = 0.f;
 		this->index = index;
 		if (this->index >= numSteps)
 			this->index = 0;
 	}
 
+	/** One master clock step: moves the playhead and the rows whose divided clock fires, and draws their gates */
+	void advance(float shapeValue, bool *gateRowOut)
+	{
+		setIndex(index + 1);
+		syncLink.steps++;
+		tick++;
+
+		int numSteps = getNumSteps();
+		for (int row = 0; row < 3; row++)
+		{
+			if (tick % rowDivision[row] != 0)
+				continue;
+
+			int length = rowLength[row] ? rowLength[row] : numSteps;
+			rowPosition[row] = rowPosition[row] + 1 >= length ? 0 : rowPosition[row] + 1;
+			rowStep[row] = (rowPosition[row] + rowOffset[row]) % length;
+			if (rowValues[row][rowStep[row]] >= getShapedRandom(shapeValue))
+			{
+				gateRowOut[row] = true;
+			}
+		}
+	}
+
+	/** Back to the first step, every row starts at its offset */
+	void resetRows()
+	{
+		setIndex(0);
+		syncLink.resets++;
+		tick = 0;
+
+		int numSteps = getNumSteps();
+		for (int row = 0; row < 3; row++)
+		{
+			rowPosition[row] = 0;
+			rowStep[row] = rowOffset[row] % (rowLength[row] ? rowLength[row] : numSteps);
+		}
+	}
+
 	float getShapedRandom(float shapeValue)
 	{
 		float shape = clamp(roundf(shapeValue), -5.f, 5.f) * .2f * .99f;
@@ -159,82 +707,87 @@ struct SEQ3st : Module
 
 	void process(const ProcessArgs &args) override
 	{
+		GS_PROFILE_PROCESS("SEQ3st");
+
+		Command command;
+		while (commands.pop(command))
+		{
+			applyCommand(command);
+		}
+
+		if (knobDivider.process())
+		{
+			processKnobs();
+		}
+
+		if (isQuantizerChanged)
+		{
+			buildQuantizer();
+		}
+
 		// Run
 		if (runningTrigger.process(params[RUN_PARAM].getValue()))
 		{
 			running = !running;
 		}
 
+		const TransportMessage *transport = transportReceiver.read(this, args);
+		SyncClock syncClock;
+		bool isSyncFollower = syncLink.follow(id, args.frame, syncClock);
+		bool isExternalClock = inputs[EXT_CLOCK_INPUT].isConnected();
+		// Advance of the internal clock, followers in the sync group extrapolate it
+		float phasePerFrame = 0.f;
+
 		bool gateIn = false;
-		bool gateRow1Out = gateRow1IsOpen;
-		bool gateRow2Out = gateRow2IsOpen;
-		bool gateRow3Out = gateRow3IsOpen;
+		bool gateRowOut[3] = {gateRowIsOpen[0], gateRowIsOpen[1], gateRowIsOpen[2]};
 
 		if (running)
 		{
 			float shapeValue = params[SHAPE_PARAM].getValue() + inputs[SHAPE_INPUT].getVoltage();
 
-			if (inputs[EXT_CLOCK_INPUT].isConnected())
+			if (isExternalClock || transport || isSyncFollower)
 			{
-				// External clock
-				if (clockTrigger.process(inputs[EXT_CLOCK_INPUT].getVoltage()))
+				// External, Seqtrol or sync group clock
+				bool clockRisingEdge = isExternalClock ? clockTrigger.process(inputs[EXT_CLOCK_INPUT].getVoltage()) : transport ? transport->clockRise : syncClock.step;
+				if (clockRisingEdge)
 				{
-					setIndex(index + 1);
-					if (params[ROW1_PARAM + index].getValue() >= getShapedRandom(shapeValue))
-					{
-						gateRow1Out = true;
-					}
-					if (params[ROW2_PARAM + index].getValue() >= getShapedRandom(shapeValue))
-					{
-						gateRow2Out = true;
-					}
-					if (params[ROW3_PARAM + index].getValue() >= getShapedRandom(shapeValue))
-					{
-						gateRow3Out = true;
-					}
+					advance(shapeValue, gateRowOut);
 				}
-				gateIn = clockTrigger.isHigh();
+				gateIn = isExternalClock ? clockTrigger.isHigh() : transport ? transport->clock : syncClock.gate;
 			}
 			else
 			{
 				// Internal clock
 				float clockTime = powf(2.0f, params[CLOCK_PARAM].getValue() + inputs[CLOCK_INPUT].getVoltage());
-				phase += clockTime * args.sampleTime;
+				phasePerFrame = clockTime * args.sampleTime;
+				phase += phasePerFrame;
 				if (phase >= 1.0f)
 				{
-					setIndex(index + 1);
-					if (params[ROW1_PARAM + index].getValue() >= getShapedRandom(shapeValue))
-					{
-						gateRow1Out = true;
-					}
-					if (params[ROW2_PARAM + index].getValue() >= getShapedRandom(shapeValue))
-					{
-						gateRow2Out = true;
-					}
-					if (params[ROW3_PARAM + index].getValue() >= getShapedRandom(shapeValue))
-					{
-						gateRow3Out = true;
-					}
+					advance(shapeValue, gateRowOut);
 				}
 				gateIn = (phase < 0.5f);
 			}
 		}
 
-		if (!gateIn)
+		// A row gate stays open for the rest of the master step it fired in
+		for (int row = 0; row < 3; row++)
 		{
-			gateRow1Out = false;
-			gateRow2Out = false;
-			gateRow3Out = false;
+			gateRowOut[row] = gateRowOut[row] && gateIn;
+			gateRowIsOpen[row] = gateRowOut[row];
 		}
 
-		gateRow1IsOpen = gateRow1Out;
-		gateRow2IsOpen = gateRow2Out;
-		gateRow3IsOpen = gateRow3Out;
-
 		// Reset
-		if (resetTrigger.process(params[RESET_PARAM].getValue() + inputs[RESET_INPUT].getVoltage()))
+		bool transportReset = transport && transport->resetRise && !inputs[RESET_INPUT].isConnected();
+		bool syncReset = isSyncFollower && syncClock.reset && !inputs[RESET_INPUT].isConnected();
+		if (resetTrigger.process(params[RESET_PARAM].getValue() + inputs[RESET_INPUT].getVoltage()) || transportReset || syncReset)
 		{
-			setIndex(0);
+			resetRows();
+		}
+		syncLink.publish(id, args.frame, phase, phasePerFrame, gateIn);
+
+		if (pageFollowsIndex && index / PAGE_STEPS != page)
+		{
+			flipPage(index / PAGE_STEPS);
 		}
 
 		// Gate buttons
@@ -242,30 +795,50 @@ struct SEQ3st : Module
 		{
 			if (gateTriggers[i].process(params[GATE_PARAM + i].getValue()))
 			{
-				gates[i] = !gates[i];
+				gates[page * PAGE_STEPS + i] = !gates[page * PAGE_STEPS + i];
 			}
-			outputs[GATE_OUTPUT + i].setVoltage((running && gateIn && i == index && gates[i]) ? 10.0f : 0.0f);
-			lights[GATE_LIGHTS + i].setSmoothBrightness((gateIn && i == index) ? (gates[i] ? 1.f : 0.33) : (gates[i] ? 0.66 : 0.0), args.sampleTime * lightDivider.getDivision());
+			outputs[GATE_OUTPUT + i].setVoltage((running && gateIn && i == index % PAGE_STEPS && gates[index]) ? 10.0f : 0.0f);
 		}
 
 		// Outputs
-		outputs[ROW1_OUTPUT].setVoltage(params[ROW1_PARAM + index].getValue());
-		outputs[ROW2_OUTPUT].setVoltage(params[ROW2_PARAM + index].getValue());
-		outputs[ROW3_OUTPUT].setVoltage(params[ROW3_PARAM + index].getValue());
+		simd::float_4 rowVoltages = quantizeRows(rowStep);
+		outputs[ROW1_OUTPUT].setVoltage(rowVoltages[0]);
+		outputs[ROW2_OUTPUT].setVoltage(rowVoltages[1]);
+		outputs[ROW3_OUTPUT].setVoltage(rowVoltages[2]);
 		outputs[GATES_OUTPUT].setVoltage((gateIn && gates[index]) ? 10.0f : 0.0f);
-		lights[RUNNING_LIGHT].value = (running);
-		lights[RESET_LIGHT].setSmoothBrightness(resetTrigger.isHigh(), args.sampleTime * lightDivider.getDivision());
-		lights[GATES_LIGHT].setSmoothBrightness(gateIn, args.sampleTime * lightDivider.getDivision());
-		lights[ROW_LIGHTS].value = outputs[ROW1_OUTPUT].value / 10.0f;
-		lights[ROW_LIGHTS + 1].value = outputs[ROW2_OUTPUT].value / 10.0f;
-		lights[ROW_LIGHTS + 2].value = outputs[ROW3_OUTPUT].value / 10.0f;
-
-		outputs[GATE_ROW1_OUTPUT].setVoltage(gateRow1Out ? 10.0f : 0.0f);
-		outputs[GATE_ROW2_OUTPUT].setVoltage(gateRow2Out ? 10.0f : 0.0f);
-		outputs[GATE_ROW3_OUTPUT].setVoltage(gateRow3Out ? 10.0f : 0.0f);
-		lights[GATE_ROW1_LIGHT].value = outputs[GATE_ROW1_OUTPUT].value / 10.0f;
-		lights[GATE_ROW2_LIGHT].value = outputs[GATE_ROW2_OUTPUT].value / 10.0f;
-		lights[GATE_ROW3_LIGHT].value = outputs[GATE_ROW3_OUTPUT].value / 10.0f;
+
+		outputs[GATE_ROW1_OUTPUT].setVoltage(gateRowOut[0] ? 10.0f : 0.0f);
+		outputs[GATE_ROW2_OUTPUT].setVoltage(gateRowOut[1] ? 10.0f : 0.0f);
+		outputs[GATE_ROW3_OUTPUT].setVoltage(gateRowOut[2] ? 10.0f : 0.0f);
+
+		// Short pulses are latched until the next snapshot
+		lightState.rowGates |= gateRowOut[0] | (gateRowOut[1] << 1) | (gateRowOut[2] << 2);
+		lightState.reset |= resetTrigger.isHigh() || transportReset;
+		lightState.gate |= gateIn;
+		if (lightDivider.process())
+		{
+			lightState.pageGates = 0;
+			for (int i = 0; i < PAGE_STEPS; i++)
+			{
+				lightState.pageGates |= gates[page * PAGE_STEPS + i] << i;
+			}
+			lightState.pageIndex = index - page * PAGE_STEPS;
+			for (int r = 0; r < 3; r++)
+			{
+				lightState.rowValues[r] = rowValues[r][rowStep[r]];
+			}
+			lightState.running = running;
+			lightSnapshot.publish(lightState);
+
+			lightState.rowGates = 0;
+			lightState.reset = false;
+			lightState.gate = false;
+		}
+
+		if (patternDivider.process())
+		{
+			publishPattern();
+		}
 	}
 };
 
@@ -282,6 +855,8 @@ struct SEQ3stWidget : ModuleWidget
 
 	SEQ3stWidget(SEQ3st *module)
 	{
+		GS_PROFILE_WIDGET("SEQ3st");
+
 		setModule(module);
 		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/SEQ3st.svg")));
 
@@ -329,6 +904,243 @@ struct SEQ3stWidget : ModuleWidget
 		addOutput(createOutput<PJ301MPort>(Vec(360, 244), module, SEQ3st::GATE_ROW3_OUTPUT));
 		addChild(createLight<MediumLight<GreenLight>>(Vec(335, 252), module, SEQ3st::GATE_ROW3_LIGHT));
 	}
+
+	void step() override
+	{
+		SEQ3st *module = dynamic_cast<SEQ3st *>(this->module);
+		if (module)
+		{
+			const SEQ3st::LightState &state = module->lightSnapshot.read();
+			float deltaTime = APP->window->getLastFrameDuration();
+
+			for (int i = 0; i < SEQ3st::PAGE_STEPS; i++)
+			{
+				bool gate = (state.pageGates >> i) & 1;
+				module->lights[SEQ3st::GATE_LIGHTS + i].setSmoothBrightness((state.gate && i == state.pageIndex) ? (gate ? 1.f : 0.33) : (gate ? 0.66 : 0.0), deltaTime);
+			}
+
+			for (int r = 0; r < 3; r++)
+			{
+				module->lights[SEQ3st::ROW_LIGHTS + r].value = state.rowValues[r] / 10.0f;
+			}
+			module->lights[SEQ3st::GATE_ROW1_LIGHT].value = state.rowGates & 1;
+			module->lights[SEQ3st::GATE_ROW2_LIGHT].value = (state.rowGates >> 1) & 1;
+			module->lights[SEQ3st::GATE_ROW3_LIGHT].value = (state.rowGates >> 2) & 1;
+
+			module->lights[SEQ3st::RUNNING_LIGHT].value = state.running;
+			module->lights[SEQ3st::RESET_LIGHT].setSmoothBrightness(state.reset, deltaTime);
+			module->lights[SEQ3st::GATES_LIGHT].setSmoothBrightness(state.gate, deltaTime);
+		}
+
+		ModuleWidget::step();
+	}
+
+	void appendContextMenu(Menu *menu) override
+	{
+		SEQ3st *module = dynamic_cast<SEQ3st *>(this->module);
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Edit page"));
+
+		struct PageItem : MenuItem
+		{
+			SEQ3st *module;
+			int page;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(SEQ3st::Command::SET_PAGE, 0, page * SEQ3st::PAGE_STEPS);
+			}
+		};
+
+		for (int i = 0; i < SEQ3st::MAX_STEPS / SEQ3st::PAGE_STEPS; i++)
+		{
+			PageItem *pageItem = createMenuItem<PageItem>(string::f("Steps %d-%d", i * SEQ3st::PAGE_STEPS + 1, (i + 1) * SEQ3st::PAGE_STEPS));
+			pageItem->rightText = CHECKMARK(module->page == i);
+			pageItem->module = module;
+			pageItem->page = i;
+			menu->addChild(pageItem);
+		}
+
+		struct PageFollowsIndexItem : MenuItem
+		{
+			SEQ3st *module;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(SEQ3st::Command::SET_PAGE_FOLLOWS_INDEX, 0, 0, 0.f, !module->pageFollowsIndex);
+			}
+		};
+
+		PageFollowsIndexItem *pageFollowsIndexItem = createMenuItem<PageFollowsIndexItem>("Follow playhead");
+		pageFollowsIndexItem->rightText = CHECKMARK(module->pageFollowsIndex);
+		pageFollowsIndexItem->module = module;
+		menu->addChild(pageFollowsIndexItem);
+
+		struct RowValueItem : MenuItem
+		{
+			SEQ3st *module;
+			int row;
+			SEQ3st::Command::Type commandType;
+			int value;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(commandType, row, value);
+			}
+		};
+
+		/** One choice per name, the first name is firstValue */
+		struct RowValueMenuItem : MenuItem
+		{
+			SEQ3st *module;
+			int row;
+			SEQ3st::Command::Type commandType;
+			int current;
+			int firstValue = 0;
+			std::vector<std::string> names;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+				for (int i = 0; i < (int)names.size(); i++)
+				{
+					RowValueItem *valueItem = createMenuItem<RowValueItem>(names[i]);
+					valueItem->rightText = CHECKMARK(current == firstValue + i);
+					valueItem->module = module;
+					valueItem->row = row;
+					valueItem->commandType = commandType;
+					valueItem->value = firstValue + i;
+					menu->addChild(valueItem);
+				}
+				return menu;
+			}
+		};
+
+		struct PolymeterRowMenuItem : MenuItem
+		{
+			SEQ3st *module;
+			int row;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+
+				RowValueMenuItem *lengthItem = createMenuItem<RowValueMenuItem>("Length", RIGHT_ARROW);
+				lengthItem->module = module;
+				lengthItem->row = row;
+				lengthItem->commandType = SEQ3st::Command::SET_ROW_LENGTH;
+				lengthItem->current = module->rowLength[row];
+				lengthItem->names.push_back("Steps knob");
+				for (int i = 1; i <= SEQ3st::MAX_STEPS; i++)
+				{
+					lengthItem->names.push_back(string::f("%d", i));
+				}
+				menu->addChild(lengthItem);
+
+				RowValueMenuItem *divisionItem = createMenuItem<RowValueMenuItem>("Clock division", RIGHT_ARROW);
+				divisionItem->module = module;
+				divisionItem->row = row;
+				divisionItem->commandType = SEQ3st::Command::SET_ROW_DIVISION;
+				divisionItem->current = module->rowDivision[row];
+				divisionItem->firstValue = 1;
+				for (int i = 1; i <= SEQ3st::MAX_DIVISION; i++)
+				{
+					divisionItem->names.push_back(string::f("/%d", i));
+				}
+				menu->addChild(divisionItem);
+
+				RowValueMenuItem *offsetItem = createMenuItem<RowValueMenuItem>("Offset", RIGHT_ARROW);
+				offsetItem->module = module;
+				offsetItem->row = row;
+				offsetItem->commandType = SEQ3st::Command::SET_ROW_OFFSET;
+				offsetItem->current = module->rowOffset[row];
+				for (int i = 0; i < SEQ3st::MAX_STEPS; i++)
+				{
+					offsetItem->names.push_back(string::f("%d", i));
+				}
+				menu->addChild(offsetItem);
+
+				return menu;
+			}
+		};
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Polymeter"));
+
+		for (int row = 0; row < 3; row++)
+		{
+			PolymeterRowMenuItem *rowItem = createMenuItem<PolymeterRowMenuItem>(string::f("Row %d", row + 1), RIGHT_ARROW);
+			std::string length = module->rowLength[row] ? string::f("%d", module->rowLength[row]) : "Steps";
+			rowItem->rightText = length + string::f(" /%d ", module->rowDivision[row]) + RIGHT_ARROW;
+			rowItem->module = module;
+			rowItem->row = row;
+			menu->addChild(rowItem);
+		}
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Quantizer"));
+
+		struct QuantizerRowMenuItem : MenuItem
+		{
+			SEQ3st *module;
+			int row;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+
+				RowValueMenuItem *scaleItem = createMenuItem<RowValueMenuItem>("Scale", RIGHT_ARROW);
+				scaleItem->module = module;
+				scaleItem->row = row;
+				scaleItem->commandType = SEQ3st::Command::SET_QUANTIZER_SCALE;
+				scaleItem->current = module->quantizerScale[row];
+				scaleItem->names.assign(scaleNames, scaleNames + NUM_SCALES);
+				menu->addChild(scaleItem);
+
+				RowValueMenuItem *rootItem = createMenuItem<RowValueMenuItem>("Root", RIGHT_ARROW);
+				rootItem->module = module;
+				rootItem->row = row;
+				rootItem->commandType = SEQ3st::Command::SET_QUANTIZER_ROOT;
+				rootItem->current = module->quantizerRoot[row];
+				rootItem->names.assign(noteNames, noteNames + 12);
+				menu->addChild(rootItem);
+
+				RowValueMenuItem *rangeItem = createMenuItem<RowValueMenuItem>("Range", RIGHT_ARROW);
+				rangeItem->module = module;
+				rangeItem->row = row;
+				rangeItem->commandType = SEQ3st::Command::SET_QUANTIZER_RANGE;
+				rangeItem->current = module->quantizerRange[row];
+				for (int i = 0; i < NUM_RANGES; i++)
+				{
+					rangeItem->names.push_back(string::f(rangeOctaves[i] == 1 ? "%d octave" : "%d octaves", rangeOctaves[i]));
+				}
+				menu->addChild(rangeItem);
+
+				return menu;
+			}
+		};
+
+		for (int row = 0; row < 3; row++)
+		{
+			QuantizerRowMenuItem *rowItem = createMenuItem<QuantizerRowMenuItem>(string::f("Row %d", row + 1), RIGHT_ARROW);
+			rowItem->rightText = std::string(scaleNames[module->quantizerScale[row]]) + " " + RIGHT_ARROW;
+			rowItem->module = module;
+			rowItem->row = row;
+			menu->addChild(rowItem);
+		}
+
+		menu->addChild(new MenuEntry);
+		PatternLibraryMenuItem *libraryItem = createMenuItem<PatternLibraryMenuItem>("Pattern library", RIGHT_ARROW);
+		libraryItem->kind = PATTERN_ROWS;
+		libraryItem->tag = module->libraryTag;
+		libraryItem->loaded = module->lastLibrary == PatternLibrary::current() ? module->libraryPattern : -1;
+		libraryItem->loadPattern = [=](const PatternLibrary *library, int entry) { module->pushCommand(SEQ3st::Command::LOAD_PATTERN, 0, entry, 0.f, (uintptr_t)library); };
+		// No CV browsing, so the filter only lives in the menu
+		libraryItem->setTag = [=](int tag) { module->libraryTag = tag; };
+		libraryItem->makeRecord = [=]() { return module->makePatternRecord(); };
+		menu->addChild(libraryItem);
+
+		SyncGroupMenuItem *syncItem = createMenuItem<SyncGroupMenuItem>("Sync group", RIGHT_ARROW);
+		syncItem->setGroup = [=](int group, bool lead) { module->pushCommand(SEQ3st::Command::SET_SYNC_GROUP, 0, group, 0.f, lead); };
+		syncItem->group = module->syncLink.group.load();
+		syncItem->isLeader = module->syncLink.isLeader(module->id);
+		menu->addChild(syncItem);
+	}
 };
 
 Model *modelSEQ3st = createModel<SEQ3st, SEQ3stWidget>("SEQ3st");
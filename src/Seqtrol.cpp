@@ -1,4 +1,7 @@
 #include "plugin.hpp"
+#include "transport.hpp"
+
+#include <algorithm>
 
 struct Seqtrol : Module
 {
@@ -18,6 +21,8 @@ struct Seqtrol : Module
 	{
 		RESET_OUTPUT,
 		CLOCK_OUTPUT,
+		TEMPO_OUTPUT,
+		BPM_OUTPUT,
 		NUM_OUTPUTS
 	};
 	enum LightIds
@@ -32,25 +37,150 @@ struct Seqtrol : Module
 	dsp::SchmittTrigger inputClockTrigger;
 	dsp::SchmittTrigger intermediateClockTrigger;
 
+	enum ResetModes
+	{
+		RESET_ON_CLOCK,
+		RESET_BEFORE_CLOCK,
+		NUM_RESET_MODES
+	};
+	enum ContinueModes
+	{
+		CONTINUE_RESUME,
+		CONTINUE_RESTART_AT_BAR,
+		NUM_CONTINUE_MODES
+	};
+
 	bool isRunning = false;
 	bool isWaitingForClockRisingEdge = false;
+	bool isWaitingForBar = false;
+	bool isResetHigh = false;
+	/** isRunning for SeqtrolWidget::step() */
+	std::atomic<bool> lightState{false};
 
 	int divisorIndex = 0;
 	int clockCounter = 0;
 
+	int resetMode = RESET_ON_CLOCK;
+	int resetLeadIndex = 2;
+	int continueMode = CONTINUE_RESUME;
+
+	/** Index of the next MIDI clock tick since the last Start */
+	int songPosition = 0;
+	/** Samples between the last two rising clock edges, 0 if unknown */
+	int clockTickPeriod = 0;
+	int samplesSinceClockTick = 0;
+	int clockHoldSamples = 0;
+
 	int counterMax[13] = {1, 3, 6, 12, 24, 48, 96, 2, 4, 8, 16, 32, 64};
+	static const int NUM_RESET_LEADS = 6;
+	int resetLeadSamples[NUM_RESET_LEADS] = {1, 2, 4, 8, 16, 32};
+	static const int ticksPerBar = 96;
+	static const int ticksPerQuarter = 24;
+
+	/** Two beats of tick intervals for the tempo estimate */
+	static const int TEMPO_WINDOW = 48;
+	int tickIntervals[TEMPO_WINDOW] = {};
+	int tickIntervalCount = 0;
+	int tickIntervalIndex = 0;
+	/** 0 until the first two ticks arrived */
+	float bpm = 0.f;
+
+	/** Tempo and clock jitter in milliseconds for the context menu */
+	struct TempoState
+	{
+		float bpm;
+		float meanJitter;
+		float maxJitter;
+	};
+	Snapshot<TempoState> tempoSnapshot;
+
+	/** Output levels of the last frame, for the edges in the transport message */
+	bool wasResetHigh = false;
+	bool wasClockHigh = false;
+
+	struct Command
+	{
+		enum Type
+		{
+			RESET,
+			SET_DIVISOR,
+			SET_CLOCK_COUNTER,
+			SET_RESET_MODE,
+			SET_RESET_LEAD,
+			SET_CONTINUE_MODE,
+			SET_SONG_POSITION
+		};
+		Type type;
+		int value;
+	};
+	CommandQueue<Command> commands;
 
 	Seqtrol()
 	{
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		configOutput(TEMPO_OUTPUT, "Tempo (0V = 120 BPM, +1V doubles, holds the last tempo without clock)");
+		configOutput(BPM_OUTPUT, "BPM (1V = 30 BPM, 0V without clock)");
+	}
+
+	/** For menus and widgets, false if the engine has not caught up and the edit was dropped */
+	bool pushCommand(Command::Type type, int value = 0)
+	{
+		if (!commands.push({type, value}))
+		{
+			WARN("Seqtrol: command queue full, edit dropped");
+			return false;
+		}
+		return true;
+	}
+
+	void applyCommand(const Command &command)
+	{
+		switch (command.type)
+		{
+		case Command::RESET:
+			reset();
+			break;
+		case Command::SET_DIVISOR:
+			divisorIndex = clamp(command.value, 0, 12);
+			break;
+		case Command::SET_CLOCK_COUNTER:
+			clockCounter = command.value;
+			break;
+		case Command::SET_RESET_MODE:
+			resetMode = clamp(command.value, 0, NUM_RESET_MODES - 1);
+			break;
+		case Command::SET_RESET_LEAD:
+			resetLeadIndex = clamp(command.value, 0, NUM_RESET_LEADS - 1);
+			break;
+		case Command::SET_CONTINUE_MODE:
+			continueMode = clamp(command.value, 0, NUM_CONTINUE_MODES - 1);
+			break;
+		case Command::SET_SONG_POSITION:
+			songPosition = command.value;
+			break;
+		}
 	}
 
 	void onReset() override
 	{
+		applyCommand({Command::RESET, 0});
+	}
+
+	void reset()
+	{
+		GS_TRACE_ZONE("Seqtrol reset");
+
 		isRunning = false;
 		isWaitingForClockRisingEdge = false;
+		isWaitingForBar = false;
+		isResetHigh = false;
 		divisorIndex = 0;
 		clockCounter = 0;
+		resetMode = RESET_ON_CLOCK;
+		resetLeadIndex = 2;
+		continueMode = CONTINUE_RESUME;
+		songPosition = 0;
+		clockHoldSamples = 0;
 	}
 
 	json_t *dataToJson() override
@@ -59,33 +189,214 @@ struct Seqtrol : Module
 
 		json_object_set_new(rootJ, "divisorIndex", json_integer(divisorIndex));
 		json_object_set_new(rootJ, "clockCounter", json_integer(clockCounter));
+		json_object_set_new(rootJ, "resetMode", json_integer(resetMode));
+		json_object_set_new(rootJ, "resetLeadIndex", json_integer(resetLeadIndex));
+		json_object_set_new(rootJ, "continueMode", json_integer(continueMode));
+		json_object_set_new(rootJ, "songPosition", json_integer(songPosition));
 
 		return rootJ;
 	}
 
 	void dataFromJson(json_t *rootJ) override
 	{
+		GS_TRACE_ZONE("Seqtrol dataFromJson");
+
 		json_t *divisorIndexJ = json_object_get(rootJ, "divisorIndex");
 		if (divisorIndexJ)
 		{
-			divisorIndex = json_integer_value(divisorIndexJ);
+			applyCommand({Command::SET_DIVISOR, (int)json_integer_value(divisorIndexJ)});
 		}
 
 		json_t *clockCounterJ = json_object_get(rootJ, "clockCounter");
 		if (clockCounterJ)
 		{
-			clockCounter = json_integer_value(clockCounterJ);
+			applyCommand({Command::SET_CLOCK_COUNTER, (int)json_integer_value(clockCounterJ)});
+		}
+
+		json_t *resetModeJ = json_object_get(rootJ, "resetMode");
+		if (resetModeJ)
+		{
+			applyCommand({Command::SET_RESET_MODE, (int)json_integer_value(resetModeJ)});
+		}
+
+		json_t *resetLeadIndexJ = json_object_get(rootJ, "resetLeadIndex");
+		if (resetLeadIndexJ)
+		{
+			applyCommand({Command::SET_RESET_LEAD, (int)json_integer_value(resetLeadIndexJ)});
+		}
+
+		json_t *continueModeJ = json_object_get(rootJ, "continueMode");
+		if (continueModeJ)
+		{
+			applyCommand({Command::SET_CONTINUE_MODE, (int)json_integer_value(continueModeJ)});
+		}
+
+		json_t *songPositionJ = json_object_get(rootJ, "songPosition");
+		if (songPositionJ)
+		{
+			applyCommand({Command::SET_SONG_POSITION, (int)json_integer_value(songPositionJ)});
+		}
+	}
+
+	void measureClockTick(bool clockRisingEdge, float sampleRate)
+	{
+		// Anything slower than one tick per second is not a running MIDI clock
+		if (samplesSinceClockTick < (int)sampleRate)
+		{
+			samplesSinceClockTick++;
+		}
+		else
+		{
+			clockTickPeriod = 0;
+			// The clock stopped, don't mix the old tempo into the next one
+			tickIntervalCount = 0;
+			tickIntervalIndex = 0;
+		}
+
+		if (clockRisingEdge)
+		{
+			if (samplesSinceClockTick < (int)sampleRate)
+			{
+				clockTickPeriod = samplesSinceClockTick;
+				estimateTempo(sampleRate);
+			}
+			samplesSinceClockTick = 0;
+		}
+	}
+
+	/** Interquartile mean of the recent tick intervals: ignores dropped and doubled ticks like a median, but doesn't step by whole samples */
+	void estimateTempo(float sampleRate)
+	{
+		tickIntervals[tickIntervalIndex] = clockTickPeriod;
+		tickIntervalIndex = (tickIntervalIndex + 1) % TEMPO_WINDOW;
+		tickIntervalCount = std::min(tickIntervalCount + 1, TEMPO_WINDOW);
+
+		int sorted[TEMPO_WINDOW];
+		std::copy(tickIntervals, tickIntervals + tickIntervalCount, sorted);
+		std::sort(sorted, sorted + tickIntervalCount);
+
+		int first = tickIntervalCount / 4;
+		int last = tickIntervalCount - tickIntervalCount / 4;
+		float interval = 0.f;
+		for (int i = first; i < last; i++)
+		{
+			interval += sorted[i];
+		}
+		interval /= last - first;
+		bpm = 60.f * sampleRate / (interval * ticksPerQuarter);
+
+		float meanJitter = 0.f;
+		float maxJitter = 0.f;
+		for (int i = 0; i < tickIntervalCount; i++)
+		{
+			float jitter = std::fabs(tickIntervals[i] - interval);
+			meanJitter += jitter;
+			maxJitter = std::max(maxJitter, jitter);
+		}
+		float msPerSample = 1000.f / sampleRate;
+		tempoSnapshot.publish({bpm, meanJitter / tickIntervalCount * msPerSample, maxJitter * msPerSample});
+	}
+
+	void processResetOnClock(bool restart)
+	{
+		if (restart || isWaitingForClockRisingEdge)
+		{
+			if (inputClockTrigger.isHigh())
+			{
+				outputs[RESET_OUTPUT].setVoltage(inputs[CLOCK_INPUT].getVoltage());
+				isWaitingForClockRisingEdge = false;
+			}
+			else
+			{
+				outputs[RESET_OUTPUT].setVoltage(0.0f);
+				isWaitingForClockRisingEdge = true;
+			}
+		}
+		else
+		{
+			outputs[RESET_OUTPUT].setVoltage(0.0f);
+		}
+	}
+
+	void processResetBeforeClock(bool restart, bool nextTickRestarts)
+	{
+		int lead = resetLeadSamples[resetLeadIndex];
+
+		// Raise reset ahead of the predicted restart tick
+		if (nextTickRestarts && !isResetHigh && clockTickPeriod > lead && samplesSinceClockTick >= clockTickPeriod - lead)
+		{
+			isResetHigh = true;
+		}
+
+		if (restart)
+		{
+			isWaitingForClockRisingEdge = false;
+			if (isResetHigh)
+			{
+				// Reset already leads the clock: forward it right away
+				isResetHigh = false;
+			}
+			else
+			{
+				// No prediction possible: send reset now and hold the clock back
+				isResetHigh = true;
+				clockHoldSamples = lead;
+			}
+		}
+		else if (clockHoldSamples > 0 && --clockHoldSamples == 0)
+		{
+			isResetHigh = false;
+		}
+
+		outputs[RESET_OUTPUT].setVoltage(isResetHigh ? 10.f : 0.f);
+	}
+
+	/** Writes the transport into every transport module in the row on the right */
+	void publishTransport(const ProcessArgs &args)
+	{
+		TransportMessage transport;
+		transport.frame = args.frame;
+		transport.running = isRunning;
+		transport.reset = outputs[RESET_OUTPUT].getVoltage() >= 1.f;
+		transport.resetRise = transport.reset && !wasResetHigh;
+		transport.clock = outputs[CLOCK_OUTPUT].getVoltage() >= 1.f;
+		transport.clockRise = transport.clock && !wasClockHigh;
+		transport.songPosition = songPosition;
+		wasResetHigh = transport.reset;
+		wasClockHigh = transport.clock;
+
+		for (Module *module = rightExpander.module; module && isTransportModel(module->model); module = module->rightExpander.module)
+		{
+			*(TransportMessage *)module->leftExpander.producerMessage = transport;
+			module->leftExpander.requestMessageFlip();
 		}
 	}
 
 	void process(const ProcessArgs &args) override
 	{
+		GS_PROFILE_PROCESS("Seqtrol");
+
+		Command command;
+		while (commands.pop(command))
+		{
+			applyCommand(command);
+		}
+
 		bool startWasTriggered = startTrigger.process(rescale(inputs[START_TRIGGER_INPUT].getVoltage(), 0.1f, 2.f, 0.f, 1.f));
 		bool continueWasTriggered = continueTrigger.process(rescale(inputs[CONTINUE_TRIGGER_INPUT].getVoltage(), 0.1f, 2.f, 0.f, 1.f));
 
 		if (startWasTriggered)
 		{
 			clockCounter = 0;
+			songPosition = 0;
+			isWaitingForBar = false;
+			isResetHigh = false;
+			clockHoldSamples = 0;
+		}
+
+		if (continueWasTriggered && !isRunning && continueMode == CONTINUE_RESTART_AT_BAR)
+		{
+			isWaitingForBar = true;
 		}
 
 		if (startWasTriggered || continueWasTriggered)
@@ -96,28 +407,53 @@ struct Seqtrol : Module
 		if (stopTrigger.process(rescale(inputs[STOP_TRIGGER_INPUT].getVoltage(), 0.1f, 2.f, 0.f, 1.f)))
 		{
 			isRunning = false;
+			isWaitingForBar = false;
 		}
 
-		inputClockTrigger.process(rescale(inputs[CLOCK_INPUT].getVoltage(), 0.1f, 2.f, 0.f, 1.f));
-		if (startWasTriggered || isWaitingForClockRisingEdge)
+		bool clockRisingEdge = inputClockTrigger.process(rescale(inputs[CLOCK_INPUT].getVoltage(), 0.1f, 2.f, 0.f, 1.f));
+		measureClockTick(clockRisingEdge, args.sampleRate);
+		if (clockRisingEdge)
 		{
-			if (inputClockTrigger.isHigh())
+			GS_TRACE_INSTANT("Seqtrol clock");
+		}
+
+		// Does the next incoming tick (re)start the clock output?
+		bool nextTickRestarts = (resetMode == RESET_BEFORE_CLOCK && isWaitingForClockRisingEdge) || (isWaitingForBar && songPosition % ticksPerBar == 0);
+
+		if (startWasTriggered && inputClockTrigger.isHigh() && !clockRisingEdge)
+		{
+			// Start arrived within the first clock pulse
+			songPosition++;
+		}
+
+		bool barRestart = false;
+		if (isRunning && clockRisingEdge)
+		{
+			if (isWaitingForBar && songPosition % ticksPerBar == 0)
 			{
-				outputs[RESET_OUTPUT].setVoltage(inputs[CLOCK_INPUT].getVoltage());
-				isWaitingForClockRisingEdge = false;
+				isWaitingForBar = false;
+				clockCounter = 0;
+				barRestart = true;
+				GS_TRACE_INSTANT("Seqtrol bar restart");
 			}
-			else
+			songPosition++;
+		}
+
+		if (resetMode == RESET_BEFORE_CLOCK)
+		{
+			if (startWasTriggered)
 			{
-				outputs[RESET_OUTPUT].setVoltage(0.0f);
 				isWaitingForClockRisingEdge = true;
 			}
+			processResetBeforeClock((isWaitingForClockRisingEdge && inputClockTrigger.isHigh()) || barRestart, nextTickRestarts);
 		}
 		else
 		{
-			outputs[RESET_OUTPUT].setVoltage(0.0f);
+			processResetOnClock(startWasTriggered || barRestart);
 		}
 
-		float intermediateClock = isRunning && !isWaitingForClockRisingEdge ? inputs[CLOCK_INPUT].getVoltage() : 0.f;
+		bool clockIsForwarded = isRunning && !isWaitingForClockRisingEdge && !isWaitingForBar && clockHoldSamples == 0;
+		float intermediateClock = clockIsForwarded ? inputs[CLOCK_INPUT].getVoltage() : 0.f;
 		if (intermediateClockTrigger.process(1.f - rescale(intermediateClock, 0.1f, 2.f, 0.f, 1.f)))
 		{
 			if (++clockCounter >= counterMax[divisorIndex])
@@ -127,7 +463,13 @@ struct Seqtrol : Module
 		}
 
 		outputs[CLOCK_OUTPUT].setVoltage(clockCounter == 0 ? intermediateClock : 0.f);
-		lights[RUNNING_LIGHT].setSmoothBrightness(isRunning ? 1.f : 0.f, 100.f);
+
+		// Without a running clock BPM drops to 0V, so patches can tell, while the tempo holds the last estimate
+		outputs[TEMPO_OUTPUT].setVoltage(bpm > 0.f ? std::log2(bpm / 120.f) : 0.f);
+		outputs[BPM_OUTPUT].setVoltage(clockTickPeriod > 0 ? clamp(bpm / 30.f, 0.f, 10.f) : 0.f);
+
+		publishTransport(args);
+		lightState.store(isRunning, std::memory_order_relaxed);
 	}
 };
 
@@ -135,11 +477,13 @@ struct SeqtrolWidget : ModuleWidget
 {
 	SeqtrolWidget(Seqtrol *module)
 	{
+		GS_PROFILE_WIDGET("Seqtrol");
+
 		setModule(module);
 		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/Seqtrol.svg")));
 
 		static const float col[3] = {5.5f, 10.16f, 14.82f};
-		static const float row[16] = {24.f, 39.f, 54.f, 69.f, 84.f, 102.f};
+		static const float row[16] = {24.f, 39.f, 54.f, 69.f, 84.f, 102.f, 112.8f};
 
 		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
 		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
@@ -155,12 +499,36 @@ struct SeqtrolWidget : ModuleWidget
 
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(col[1], row[4])), module, Seqtrol::RESET_OUTPUT));
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(col[1], row[5])), module, Seqtrol::CLOCK_OUTPUT));
+		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(col[0], row[6])), module, Seqtrol::TEMPO_OUTPUT));
+		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(col[2], row[6])), module, Seqtrol::BPM_OUTPUT));
+	}
+
+	void step() override
+	{
+		if (module)
+		{
+			module->lights[Seqtrol::RUNNING_LIGHT].value = dynamic_cast<Seqtrol *>(module)->lightState.load(std::memory_order_relaxed);
+		}
+
+		ModuleWidget::step();
 	}
 
 	void appendContextMenu(Menu *menu) override
 	{
 		Seqtrol *module = dynamic_cast<Seqtrol *>(this->module);
 
+		menu->addChild(new MenuEntry);
+		const Seqtrol::TempoState &tempo = module->tempoSnapshot.read();
+		if (tempo.bpm > 0.f)
+		{
+			menu->addChild(createMenuLabel(string::f("Tempo: %.2f BPM", tempo.bpm)));
+			menu->addChild(createMenuLabel(string::f("Clock jitter: %.3f ms mean, %.3f ms max", tempo.meanJitter, tempo.maxJitter)));
+		}
+		else
+		{
+			menu->addChild(createMenuLabel("Tempo: no clock"));
+		}
+
 		menu->addChild(new MenuEntry);
 		menu->addChild(createMenuLabel("Clock divisor"));
 
@@ -170,7 +538,7 @@ struct SeqtrolWidget : ModuleWidget
 			int divisorIndex;
 			void onAction(const event::Action &e) override
 			{
-				module->divisorIndex = divisorIndex;
+				module->pushCommand(Seqtrol::Command::SET_DIVISOR, divisorIndex);
 			}
 		};
 
@@ -183,6 +551,85 @@ struct SeqtrolWidget : ModuleWidget
 			divisorItem->divisorIndex = i;
 			menu->addChild(divisorItem);
 		}
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Reset"));
+
+		struct ResetModeItem : MenuItem
+		{
+			Seqtrol *module;
+			int resetMode;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(Seqtrol::Command::SET_RESET_MODE, resetMode);
+			}
+		};
+
+		std::string resetModeNames[Seqtrol::NUM_RESET_MODES] = {"With first clock", "Before first clock"};
+		for (int i = 0; i < Seqtrol::NUM_RESET_MODES; i++)
+		{
+			ResetModeItem *resetModeItem = createMenuItem<ResetModeItem>(resetModeNames[i]);
+			resetModeItem->rightText = CHECKMARK(module->resetMode == i);
+			resetModeItem->module = module;
+			resetModeItem->resetMode = i;
+			menu->addChild(resetModeItem);
+		}
+
+		struct ResetLeadItem : MenuItem
+		{
+			Seqtrol *module;
+			int resetLeadIndex;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(Seqtrol::Command::SET_RESET_LEAD, resetLeadIndex);
+			}
+		};
+
+		struct ResetLeadMenuItem : MenuItem
+		{
+			Seqtrol *module;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+				for (int i = 0; i < Seqtrol::NUM_RESET_LEADS; i++)
+				{
+					ResetLeadItem *resetLeadItem = createMenuItem<ResetLeadItem>(string::f("%d samples", module->resetLeadSamples[i]));
+					resetLeadItem->rightText = CHECKMARK(module->resetLeadIndex == i);
+					resetLeadItem->module = module;
+					resetLeadItem->resetLeadIndex = i;
+					menu->addChild(resetLeadItem);
+				}
+				return menu;
+			}
+		};
+
+		ResetLeadMenuItem *resetLeadMenuItem = createMenuItem<ResetLeadMenuItem>("Reset lead", RIGHT_ARROW);
+		resetLeadMenuItem->module = module;
+		resetLeadMenuItem->disabled = module->resetMode != Seqtrol::RESET_BEFORE_CLOCK;
+		menu->addChild(resetLeadMenuItem);
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Continue"));
+
+		struct ContinueModeItem : MenuItem
+		{
+			Seqtrol *module;
+			int continueMode;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(Seqtrol::Command::SET_CONTINUE_MODE, continueMode);
+			}
+		};
+
+		std::string continueModeNames[Seqtrol::NUM_CONTINUE_MODES] = {"Resume", "Restart at next bar"};
+		for (int i = 0; i < Seqtrol::NUM_CONTINUE_MODES; i++)
+		{
+			ContinueModeItem *continueModeItem = createMenuItem<ContinueModeItem>(continueModeNames[i]);
+			continueModeItem->rightText = CHECKMARK(module->continueMode == i);
+			continueModeItem->module = module;
+			continueModeItem->continueMode = i;
+			menu->addChild(continueModeItem);
+		}
 	}
 };
 
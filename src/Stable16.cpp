@@ -1,18 +1,39 @@
 #include "plugin.hpp"
+#include "euclid.hpp"
+#include "patternmenu.hpp"
+#include "syncgroup.hpp"
+#include "transport.hpp"
 
-struct Stable16 : Module
+/** Steps of one row, bit x is step x */
+template <int COLS>
+using StepWord = typename std::conditional<COLS <= 16, uint16_t, typename std::conditional<COLS <= 32, uint32_t, uint64_t>::type>::type;
+
+/** The Stable16 engine for any grid size. Stable16 is GateMatrix<8, 16>. */
+template <int ROWS, int COLS>
+struct GateMatrix : Module
 {
+	static_assert(ROWS % 4 == 0 && ROWS <= 16, "Rows are decided in groups of four");
+	static_assert(COLS <= 64, "A row must fit into 64 bits");
+
+	typedef StepWord<COLS> Steps;
+
+	/** Swing and microtiming delay a step by at most half a step, so its gate ends before the next clock */
+	static const int MAX_DELAY = 50;
+
+	/** Stable16 patches have one param per step, the later layouts toggle steps by command only */
+	static const int NUM_STEP_PARAMS = ROWS == 8 && COLS == 16 ? ROWS * COLS : 0;
+
 	enum ParamIds
 	{
 		CLOCK_PARAM,
 		RUN_PARAM,
 		RESET_PARAM,
-		ENUMS(STEP_PARAM, 128),
-		ENUMS(START_PARAM, 8),
-		ENUMS(END_PARAM, 8),
-		ENUMS(MUTE_PARAM, 8),
-		ENUMS(NUDGE_LEFT_PARAM, 8),
-		ENUMS(NUDGE_RIGHT_PARAM, 8),
+		ENUMS(STEP_PARAM, NUM_STEP_PARAMS),
+		ENUMS(START_PARAM, ROWS),
+		ENUMS(END_PARAM, ROWS),
+		ENUMS(MUTE_PARAM, ROWS),
+		ENUMS(NUDGE_LEFT_PARAM, ROWS),
+		ENUMS(NUDGE_RIGHT_PARAM, ROWS),
 		NUDGE_MODE_PARAM,
 		NUM_PARAMS
 	};
@@ -21,84 +42,359 @@ struct Stable16 : Module
 		CLOCK_INPUT,
 		EXT_CLOCK_INPUT,
 		RESET_INPUT,
+		EUCLID_PULSES_INPUT,
+		EUCLID_LENGTH_INPUT,
+		EUCLID_ROTATION_INPUT,
+		LIBRARY_INPUT,
+		START_INPUT,
+		END_INPUT,
+		MUTATE_INPUT,
+		MUTATION_CHANCE_INPUT,
 		NUM_INPUTS
 	};
 	enum OutputIds
 	{
 		GATES_OUTPUT,
-		ENUMS(ROW_OUTPUT, 8),
-		ENUMS(GATE_OUTPUT, 8),
+		ENUMS(ROW_OUTPUT, ROWS),
+		ENUMS(GATE_OUTPUT, ROWS),
 		NUM_OUTPUTS
 	};
 	enum LightIds
 	{
-		ENUMS(STEP_LIGHT, 128),
+		ENUMS(STEP_LIGHT, ROWS * COLS),
 		RUNNING_LIGHT,
 		RESET_LIGHT,
 		GATES_LIGHT,
-		ENUMS(ROW_LIGHTS, 8),
-		ENUMS(GATE_LIGHTS, 8),
+		ENUMS(ROW_LIGHTS, ROWS),
+		ENUMS(GATE_LIGHTS, ROWS),
 		NUM_LIGHTS
 	};
 
 	bool running = true;
 	dsp::SchmittTrigger clockTrigger;
 	dsp::SchmittTrigger runningTrigger;
-	dsp::SchmittTrigger stepTrigger[128];
 	dsp::SchmittTrigger resetTrigger;
-	dsp::SchmittTrigger gateTriggers[8];
-	dsp::SchmittTrigger nudgeLeftTriggers[8];
-	dsp::SchmittTrigger nudgeRightTriggers[8];
+	dsp::SchmittTrigger gateTriggers[ROWS];
+	dsp::SchmittTrigger nudgeLeftTriggers[ROWS];
+	dsp::SchmittTrigger nudgeRightTriggers[ROWS];
 	/** Phase of internal LFO */
 	float phase = 0.f;
-	bool stepValue[128] = {};
-	int rowStepIndex[8] = {0, 0, 0, 0, 0, 0, 0};
-	int rowStepIncrement[8] = {1, 1, 1, 1, 1, 1, 1, 1};
-	bool mute[8] = {false, false, false, false, false, false, false, false};
+	/** One word per row, bit x is step x */
+	Steps rowSteps[ROWS] = {};
+	int rowStepIndex[ROWS] = {};
+	int rowStepIncrement[ROWS];
+	bool mute[ROWS] = {};
 	bool nudgeModeInternal = false;
+	/** Chance in percent that a set step plays */
+	uint8_t stepProbability[ROWS][COLS];
+	/** Bit y is set if row y plays its current step, drawn once per step */
+	int rowDecisions = (1 << ROWS) - 1;
+	/** Loop window per row, knob plus CV, updated every sample */
+	int rowStart[ROWS] = {};
+	int rowEnd[ROWS];
+	/** Bit x is set if step x is inside the row's window */
+	uint64_t windowMask[ROWS];
+
+	/** Delay of odd steps in percent of a step, for all rows */
+	int swing = 0;
+	/** Added to the global swing */
+	int rowSwing[ROWS] = {};
+	/** Per-step delay in percent of a step */
+	uint8_t stepMicrotiming[ROWS][COLS] = {};
+	/** Swing plus microtiming in samples, for a step period of timingPeriod samples */
+	uint32_t stepDelay[ROWS][COLS] = {};
+	uint32_t timingPeriod = 0;
+	bool isTimingChanged = true;
+	uint32_t samplesSinceClock = 0;
+	/** Clock and reset from a Seqtrol on the left */
+	TransportReceiver transportReceiver;
+	/** Clock and reset from the leader of a sync group */
+	SyncLink syncLink;
 
+	struct EuclidGenerator
+	{
+		bool enabled = false;
+		int pulses = 4;
+		int length = COLS;
+		int rotation = 0;
+		/** Last (length, pulses, rotation, start) that was written into the row */
+		int lastKey = -1;
+	};
+	EuclidGenerator euclid[ROWS];
+
+	enum MutationModes
+	{
+		/** Rotate the window by one step, the step that wraps around flips by chance */
+		MUTATE_SHIFT,
+		/** One random step of the window flips by chance */
+		MUTATE_FLIP,
+		/** The row ignores mutate triggers */
+		MUTATE_LOCK,
+		NUM_MUTATION_MODES
+	};
+	int mutationMode[ROWS] = {};
+	dsp::TSchmittTrigger<simd::float_4> mutateTriggers[ROWS / 4];
+
+	/** Tag filter for browsing the pattern library by CV, -1 for all */
+	int libraryTag = -1;
+	/** Library entry that was loaded last */
+	int libraryPattern = -1;
+	const PatternLibrary *lastLibrary = nullptr;
+
+	struct Command
+	{
+		enum Type
+		{
+			RESET,
+			SET_RUNNING,
+			SET_ROW_STEPS,
+			SET_POSITION,
+			SET_INCREMENT,
+			SET_EUCLID_ENABLED,
+			SET_EUCLID_PULSES,
+			SET_EUCLID_LENGTH,
+			SET_EUCLID_ROTATION,
+			/** Take the row's current steps as the generator output */
+			SYNC_EUCLID,
+			SET_PROBABILITY,
+			/** value is the entry, bits the PatternLibrary it is in */
+			LOAD_PATTERN,
+			SET_LIBRARY_TAG,
+			SET_SWING,
+			SET_ROW_SWING,
+			SET_MICROTIMING,
+			/** Flips the steps set in bits, for clicks and their undo */
+			TOGGLE_STEPS,
+			/** Nudge within an explicit window, value is the direction (1 is left), step the start and bits the end */
+			NUDGE_WINDOW,
+			SET_MUTATION_MODE,
+			/** value is the group, -1 for none, step is 1 to lead it */
+			SET_SYNC_GROUP
+		};
+		Type type;
+		int row;
+		int value;
+		int step;
+		/** For SET_ROW_STEPS bit x is step x */
+		uint64_t bits;
+	};
+	CommandQueue<Command, 16> commands;
+
+	/** A nudge from the buttons, with the window it rotated */
+	struct Nudge
+	{
+		int row;
+		bool toLeft;
+		int start;
+		int end;
+	};
+	/** The other way round: the engine pushes, GateMatrixWidget::step() turns them into undo history */
+	CommandQueue<Nudge, 16> nudges;
+
+	/** What the panel shows, GateMatrixWidget::step() derives the lights from it */
+	struct LightState
+	{
+		Steps rowSteps[ROWS];
+		uint8_t rowStepIndex[ROWS];
+		uint8_t stepProbability[ROWS][COLS];
+		/** Bit y is set if row y's output was high since the last snapshot */
+		uint32_t rowGates;
+		bool running;
+		bool reset;
+		bool gate;
+	};
+	LightState lightState = {};
+	Snapshot<LightState> lightSnapshot;
 	dsp::ClockDivider lightDivider;
 
-	Stable16()
+	GateMatrix()
 	{
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
-		for (int x = 0; x < 16; x++)
+		transportReceiver.attach(this);
+		// The step grid toggles steps by command, the step params only keep the param ids of older patches
+		for (int i = 0; i < NUM_STEP_PARAMS; i++)
 		{
-			for (int y = 0; y < 8; y++)
-			{
-				configParam(Stable16::STEP_PARAM + x + 16 * y, 0.f, 1.f, 0.f);
-			}
+			configParam(STEP_PARAM + i, 0.f, 1.f, 0.f);
+		}
+
+		for (int y = 0; y < ROWS; y++)
+		{
+			configParam(START_PARAM + y, 0.f, COLS - 1.f, 0.f, "Start");
+			configParam(END_PARAM + y, 0.f, COLS - 1.f, COLS - 1.f, "End");
+			configParam(NUDGE_LEFT_PARAM + y, 0.f, 1.f, 0.f, "Nudge left");
+			configParam(NUDGE_RIGHT_PARAM + y, 0.f, 1.f, 0.f, "Nudge right");
+			rowStepIncrement[y] = 1;
+			rowEnd[y] = COLS - 1;
+			windowMask[y] = lowSteps(COLS);
+		}
+
+		configParam(CLOCK_PARAM, -2.f, 6.f, 2.f, "Tempo");
+		configParam(RUN_PARAM, 0.f, 1.f, 0.f, "Run/Stop");
+		configParam(RESET_PARAM, 0.f, 1.f, 0.f, "Reset");
+		configParam(NUDGE_MODE_PARAM, 0.f, 1.f, 0.f, "Nudge mode");
+
+		configInput(EUCLID_PULSES_INPUT, "Euclidean pulses (poly, one channel per row)");
+		configInput(EUCLID_LENGTH_INPUT, "Euclidean length (poly, one channel per row)");
+		configInput(EUCLID_ROTATION_INPUT, "Euclidean rotation (poly, one channel per row)");
+		configInput(LIBRARY_INPUT, "Pattern library browse");
+		configInput(START_INPUT, "Start (poly, one channel per row)");
+		configInput(END_INPUT, "End (poly, one channel per row)");
+		configInput(MUTATE_INPUT, "Mutate trigger (poly, one channel per row)");
+		configInput(MUTATION_CHANCE_INPUT, "Mutation chance, 10V = 100% (poly, one channel per row)");
+
+		std::memset(stepProbability, 100, sizeof(stepProbability));
+		lightDivider.setDivision(32);
+	}
+
+	/** For menus and widgets, false if the engine has not caught up and the edit was dropped */
+	bool pushCommand(typename Command::Type type, int row = 0, int value = 0, int step = 0, uint64_t bits = 0)
+	{
+		if (!commands.push({type, row, value, step, bits}))
+		{
+			WARN("GateMatrix: command queue full, edit dropped");
+			return false;
 		}
+		return true;
+	}
+
+	/** Undo and redo must not lose an edit, what the full queue refused is pushed again from GateMatrixWidget::step() */
+	std::vector<Command> historyCommands;
 
-		for (int y = 0; y < 8; y++)
+	/** UI thread, queues behind earlier refused edits so the diffs replay in order */
+	void pushHistoryCommand(typename Command::Type type, int row, int value = 0, int step = 0, uint64_t bits = 0)
+	{
+		historyCommands.push_back({type, row, value, step, bits});
+		flushHistoryCommands();
+	}
+
+	void flushHistoryCommands()
+	{
+		size_t pushed = 0;
+		while (pushed < historyCommands.size() && commands.push(historyCommands[pushed]))
 		{
-			configParam(Stable16::START_PARAM + y, 0.f, 15.f, 0.f, "Start");
-			configParam(Stable16::END_PARAM + y, 0.f, 15.f, 15.f, "End");
-			configParam(Stable16::NUDGE_LEFT_PARAM + y, 0.f, 1.f, 0.f, "Nudge left");
-			configParam(Stable16::NUDGE_RIGHT_PARAM + y, 0.f, 1.f, 0.f, "Nudge right");
+			pushed++;
 		}
+		historyCommands.erase(historyCommands.begin(), historyCommands.begin() + pushed);
+	}
 
-		configParam(Stable16::CLOCK_PARAM, -2.f, 6.f, 2.f, "Tempo");
-		configParam(Stable16::RUN_PARAM, 0.f, 1.f, 0.f, "Run/Stop");
-		configParam(Stable16::RESET_PARAM, 0.f, 1.f, 0.f, "Reset");
-		configParam(Stable16::NUDGE_MODE_PARAM, 0.f, 1.f, 0.f, "Nudge mode");
+	/** For onReset, onRandomize and dataFromJson, Rack serializes the module right after them */
+	void applyState(typename Command::Type type, int row = 0, int value = 0, int step = 0, uint64_t bits = 0)
+	{
+		applyCommand({type, row, value, step, bits});
+	}
 
-		onReset();
+	void applyCommand(const Command &command)
+	{
+		int row = clamp(command.row, 0, ROWS - 1);
+		switch (command.type)
+		{
+		case Command::RESET:
+			for (int i = 0; i < ROWS; i++)
+			{
+				rowStepIndex[i] = 0;
+			}
+			break;
+		case Command::SET_RUNNING:
+			running = command.value;
+			break;
+		case Command::SET_ROW_STEPS:
+			GS_TRACE_INSTANT("GateMatrix set row steps");
+			rowSteps[row] = (Steps)command.bits;
+			break;
+		case Command::SET_POSITION:
+			rowStepIndex[row] = clamp(command.value, 0, COLS - 1);
+			break;
+		case Command::SET_INCREMENT:
+			rowStepIncrement[row] = command.value;
+			break;
+		case Command::SET_EUCLID_ENABLED:
+			euclid[row].enabled = command.value;
+			euclid[row].lastKey = -1;
+			break;
+		case Command::SET_EUCLID_PULSES:
+			euclid[row].pulses = clamp(command.value, 0, COLS);
+			break;
+		case Command::SET_EUCLID_LENGTH:
+			euclid[row].length = clamp(command.value, 1, COLS);
+			break;
+		case Command::SET_EUCLID_ROTATION:
+			euclid[row].rotation = clamp(command.value, 0, COLS - 1);
+			break;
+		case Command::SYNC_EUCLID:
+			euclid[row].lastKey = getEuclidKey(row);
+			break;
+		case Command::SET_PROBABILITY:
+			stepProbability[row][clamp(command.step, 0, COLS - 1)] = (uint8_t)clamp(command.value, 0, 100);
+			break;
+		case Command::LOAD_PATTERN:
+			loadPattern((const PatternLibrary *)(uintptr_t)command.bits, command.value);
+			break;
+		case Command::SET_LIBRARY_TAG:
+			libraryTag = command.value;
+			libraryPattern = -1;
+			break;
+		case Command::SET_SWING:
+			swing = clamp(command.value, 0, MAX_DELAY);
+			isTimingChanged = true;
+			break;
+		case Command::SET_ROW_SWING:
+			rowSwing[row] = clamp(command.value, -MAX_DELAY, MAX_DELAY);
+			isTimingChanged = true;
+			break;
+		case Command::TOGGLE_STEPS:
+			rowSteps[row] ^= (Steps)command.bits;
+			break;
+		case Command::NUDGE_WINDOW:
+			nudgeWindow(row, command.value, clamp(command.step, 0, COLS - 1), clamp((int)command.bits, 0, COLS - 1));
+			break;
+		case Command::SET_MICROTIMING:
+			stepMicrotiming[row][clamp(command.step, 0, COLS - 1)] = (uint8_t)clamp(command.value, 0, MAX_DELAY);
+			isTimingChanged = true;
+			break;
+		case Command::SET_MUTATION_MODE:
+			mutationMode[row] = clamp(command.value, 0, NUM_MUTATION_MODES - 1);
+			break;
+		case Command::SET_SYNC_GROUP:
+			syncLink.join(command.value, command.step, id);
+			break;
+		}
+	}
+
+	~GateMatrix()
+	{
+		syncLink.leave(id);
 	}
 
 	void onReset() override
 	{
-		for (int i = 0; i < 8; i++)
+		applyState(Command::RESET);
+		applyState(Command::SET_SYNC_GROUP, 0, -1);
+	}
+
+	void onPortChange(const PortChangeEvent &e) override
+	{
+		// Map the library before the engine browses it
+		if (e.connecting && e.type == engine::Port::INPUT && e.portId == LIBRARY_INPUT)
 		{
-			rowStepIndex[i] = 0;
+			PatternLibrary::load();
 		}
 	}
 
 	void onRandomize() override
 	{
-		for (int i = 0; i < 128; i++)
+		GS_TRACE_ZONE("GateMatrix randomize");
+
+		for (int y = 0; y < ROWS; y++)
 		{
-			stepValue[i] = (random::uniform() > 0.5f);
+			uint64_t steps = 0;
+			for (int x = 0; x < COLS; x++)
+			{
+				if (random::uniform() > 0.5f)
+				{
+					steps |= 1ull << x;
+				}
+			}
+			applyState(Command::SET_ROW_STEPS, y, 0, 0, steps);
 		}
 	}
 
@@ -111,15 +407,23 @@ struct Stable16 : Module
 
 		// steps
 		json_t *stepsJ = json_array();
-		for (int i = 0; i < 128; i++)
+		for (int i = 0; i < ROWS * COLS; i++)
 		{
-			json_array_insert_new(stepsJ, i, json_boolean(stepValue[i]));
+			json_array_insert_new(stepsJ, i, json_boolean(getStep(i / COLS, i % COLS)));
 		}
 		json_object_set_new(rootJ, "steps", stepsJ);
 
+		// step probabilities
+		json_t *probabilitiesJ = json_array();
+		for (int i = 0; i < ROWS * COLS; i++)
+		{
+			json_array_insert_new(probabilitiesJ, i, json_integer(stepProbability[i / COLS][i % COLS]));
+		}
+		json_object_set_new(rootJ, "probabilities", probabilitiesJ);
+
 		// mutes
 		json_t *mutesJ = json_array();
-		for (int i = 0; i < 8; i++)
+		for (int i = 0; i < ROWS; i++)
 		{
 			json_array_insert_new(mutesJ, i, json_boolean(mute[i]));
 		}
@@ -127,7 +431,7 @@ struct Stable16 : Module
 
 		// position
 		json_t *rowPositionJ = json_array();
-		for (int i = 0; i < 8; i++)
+		for (int i = 0; i < ROWS; i++)
 		{
 			json_array_insert_new(rowPositionJ, i, json_integer(rowStepIndex[i]));
 		}
@@ -138,34 +442,102 @@ struct Stable16 : Module
 
 		// increment
 		json_t *rowStepIncrementJ = json_array();
-		for (int i = 0; i < 8; i++)
+		for (int i = 0; i < ROWS; i++)
 		{
 			json_array_insert_new(rowStepIncrementJ, i, json_integer(rowStepIncrement[i]));
 		}
 		json_object_set_new(rootJ, "increments", rowStepIncrementJ);
 
+		// euclidean generators
+		json_t *euclidsJ = json_array();
+		for (int i = 0; i < ROWS; i++)
+		{
+			json_t *euclidJ = json_object();
+			json_object_set_new(euclidJ, "enabled", json_boolean(euclid[i].enabled));
+			json_object_set_new(euclidJ, "pulses", json_integer(euclid[i].pulses));
+			json_object_set_new(euclidJ, "length", json_integer(euclid[i].length));
+			json_object_set_new(euclidJ, "rotation", json_integer(euclid[i].rotation));
+			json_array_insert_new(euclidsJ, i, euclidJ);
+		}
+		json_object_set_new(rootJ, "euclid", euclidsJ);
+
+		// swing and microtiming
+		json_object_set_new(rootJ, "swing", json_integer(swing));
+		json_t *rowSwingsJ = json_array();
+		for (int i = 0; i < ROWS; i++)
+		{
+			json_array_insert_new(rowSwingsJ, i, json_integer(rowSwing[i]));
+		}
+		json_object_set_new(rootJ, "rowSwing", rowSwingsJ);
+		json_t *microtimingsJ = json_array();
+		for (int i = 0; i < ROWS * COLS; i++)
+		{
+			json_array_insert_new(microtimingsJ, i, json_integer(stepMicrotiming[i / COLS][i % COLS]));
+		}
+		json_object_set_new(rootJ, "microtiming", microtimingsJ);
+
+		// mutation
+		json_t *mutationModesJ = json_array();
+		for (int y = 0; y < ROWS; y++)
+		{
+			json_array_insert_new(mutationModesJ, y, json_integer(mutationMode[y]));
+		}
+		json_object_set_new(rootJ, "mutationModes", mutationModesJ);
+
+		// pattern library tag, by name since tag numbers change with the file
+		PatternLibrary *library = PatternLibrary::current();
+		if (library && libraryTag >= 0 && libraryTag < library->getTagCount())
+		{
+			json_object_set_new(rootJ, "libraryTag", json_string(library->getTagName(libraryTag)));
+		}
+
+		// sync group
+		json_object_set_new(rootJ, "syncGroup", json_integer(syncLink.group.load()));
+		json_object_set_new(rootJ, "syncLeader", json_boolean(syncLink.isLeader(id)));
+
 		return rootJ;
 	}
 
 	void dataFromJson(json_t *rootJ) override
 	{
+		GS_TRACE_ZONE("GateMatrix dataFromJson");
+
 		// running
 		json_t *runningJ = json_object_get(rootJ, "running");
 		if (runningJ)
 		{
-			running = json_is_true(runningJ);
+			applyState(Command::SET_RUNNING, 0, json_is_true(runningJ));
 		}
 
 		// steps
 		json_t *stepsJ = json_object_get(rootJ, "steps");
 		if (stepsJ)
 		{
-			for (int i = 0; i < 128; i++)
+			for (int y = 0; y < ROWS; y++)
+			{
+				uint64_t steps = 0;
+				for (int x = 0; x < COLS; x++)
+				{
+					json_t *stepJ = json_array_get(stepsJ, COLS * y + x);
+					if (stepJ && json_boolean_value(stepJ))
+					{
+						steps |= 1ull << x;
+					}
+				}
+				applyState(Command::SET_ROW_STEPS, y, 0, 0, steps);
+			}
+		}
+
+		// step probabilities
+		json_t *probabilitiesJ = json_object_get(rootJ, "probabilities");
+		if (probabilitiesJ)
+		{
+			for (int i = 0; i < ROWS * COLS; i++)
 			{
-				json_t *stepJ = json_array_get(stepsJ, i);
-				if (stepJ)
+				json_t *probabilityJ = json_array_get(probabilitiesJ, i);
+				if (probabilityJ)
 				{
-					stepValue[i] = json_boolean_value(stepJ);
+					applyState(Command::SET_PROBABILITY, i / COLS, json_integer_value(probabilityJ), i % COLS);
 				}
 			}
 		}
@@ -174,7 +546,7 @@ struct Stable16 : Module
 		json_t *mutesJ = json_object_get(rootJ, "mutes");
 		if (mutesJ)
 		{
-			for (int i = 0; i < 8; i++)
+			for (int i = 0; i < ROWS; i++)
 			{
 				json_t *muteJ = json_array_get(mutesJ, i);
 				if (muteJ)
@@ -188,12 +560,12 @@ struct Stable16 : Module
 		json_t *positionsJ = json_object_get(rootJ, "positions");
 		if (positionsJ)
 		{
-			for (int i = 0; i < 8; i++)
+			for (int i = 0; i < ROWS; i++)
 			{
 				json_t *positionJ = json_array_get(positionsJ, i);
 				if (positionJ)
 				{
-					rowStepIndex[i] = json_integer_value(positionJ);
+					applyState(Command::SET_POSITION, i, json_integer_value(positionJ));
 				}
 			}
 		}
@@ -202,110 +574,463 @@ struct Stable16 : Module
 		json_t *nudgeModeInternalJ = json_object_get(rootJ, "nudge_mode_internal");
 		if (nudgeModeInternalJ)
 		{
-			nudgeModeInternal = json_is_true(nudgeModeInternalJ);
-			params[NUDGE_MODE_PARAM].setValue(nudgeModeInternal ? 1.f : 0.f);
+			params[NUDGE_MODE_PARAM].setValue(json_is_true(nudgeModeInternalJ) ? 1.f : 0.f);
 		}
 
 		// increment (rowStepIncrement)
 		json_t *incrementsJ = json_object_get(rootJ, "increment");
 		if (incrementsJ)
 		{
-			for (int i = 0; i < 8; i++)
+			for (int i = 0; i < ROWS; i++)
 			{
 				json_t *incrementJ = json_array_get(incrementsJ, i);
 				if (incrementJ)
 				{
-					rowStepIncrement[i] = json_integer_value(incrementJ);
+					applyState(Command::SET_INCREMENT, i, json_integer_value(incrementJ));
+				}
+			}
+		}
+
+		// euclidean generators
+		json_t *euclidsJ = json_object_get(rootJ, "euclid");
+		if (euclidsJ)
+		{
+			for (int i = 0; i < ROWS; i++)
+			{
+				json_t *euclidJ = json_array_get(euclidsJ, i);
+				if (euclidJ)
+				{
+					json_t *enabledJ = json_object_get(euclidJ, "enabled");
+					json_t *pulsesJ = json_object_get(euclidJ, "pulses");
+					json_t *lengthJ = json_object_get(euclidJ, "length");
+					json_t *rotationJ = json_object_get(euclidJ, "rotation");
+					if (enabledJ)
+						applyState(Command::SET_EUCLID_ENABLED, i, json_is_true(enabledJ));
+					if (pulsesJ)
+						applyState(Command::SET_EUCLID_PULSES, i, json_integer_value(pulsesJ));
+					if (lengthJ)
+						applyState(Command::SET_EUCLID_LENGTH, i, json_integer_value(lengthJ));
+					if (rotationJ)
+						applyState(Command::SET_EUCLID_ROTATION, i, json_integer_value(rotationJ));
+					// The saved steps already hold the generated pattern
+					applyState(Command::SYNC_EUCLID, i);
 				}
 			}
 		}
+
+		// swing and microtiming
+		json_t *swingJ = json_object_get(rootJ, "swing");
+		if (swingJ)
+		{
+			applyState(Command::SET_SWING, 0, json_integer_value(swingJ));
+		}
+		json_t *rowSwingsJ = json_object_get(rootJ, "rowSwing");
+		for (int i = 0; rowSwingsJ && i < ROWS; i++)
+		{
+			json_t *rowSwingJ = json_array_get(rowSwingsJ, i);
+			if (rowSwingJ)
+			{
+				applyState(Command::SET_ROW_SWING, i, json_integer_value(rowSwingJ));
+			}
+		}
+		json_t *microtimingsJ = json_object_get(rootJ, "microtiming");
+		for (int i = 0; microtimingsJ && i < ROWS * COLS; i++)
+		{
+			json_t *microtimingJ = json_array_get(microtimingsJ, i);
+			if (microtimingJ)
+			{
+				applyState(Command::SET_MICROTIMING, i / COLS, json_integer_value(microtimingJ), i % COLS);
+			}
+		}
+
+		// mutation
+		json_t *mutationModesJ = json_object_get(rootJ, "mutationModes");
+		for (int i = 0; mutationModesJ && i < ROWS; i++)
+		{
+			json_t *mutationModeJ = json_array_get(mutationModesJ, i);
+			if (mutationModeJ)
+			{
+				applyState(Command::SET_MUTATION_MODE, i, json_integer_value(mutationModeJ));
+			}
+		}
+
+		// pattern library tag
+		json_t *libraryTagJ = json_object_get(rootJ, "libraryTag");
+		if (libraryTagJ)
+		{
+			PatternLibrary *library = PatternLibrary::load();
+			if (library)
+			{
+				applyState(Command::SET_LIBRARY_TAG, 0, library->findTag(json_string_value(libraryTagJ)));
+			}
+		}
+
+		// sync group
+		json_t *syncGroupJ = json_object_get(rootJ, "syncGroup");
+		if (syncGroupJ)
+		{
+			syncLink.restore(json_integer_value(syncGroupJ), json_is_true(json_object_get(rootJ, "syncLeader")), id);
+		}
+	}
+
+	bool getStep(int row, int step)
+	{
+		return (rowSteps[row] >> step) & 1;
 	}
 
 	void resetStepIndices()
 	{
 		phase = 0.f;
+		samplesSinceClock = 0;
 
-		for (int row = 0; row < 8; row++)
+		for (int row = 0; row < ROWS; row++)
 		{
-			rowStepIndex[row] = (int)params[START_PARAM + row].getValue();
+			rowStepIndex[row] = rowStart[row];
+		}
+		decideSteps();
+		syncLink.resets++;
+	}
+
+	/** Draws whether each row plays its current step, four rows per vector compare */
+	void decideSteps()
+	{
+		float draws[ROWS];
+		float probabilities[ROWS];
+		for (int row = 0; row < ROWS; row++)
+		{
+			draws[row] = random::uniform() * 100.f;
+			probabilities[row] = stepProbability[row][clamp(rowStepIndex[row], 0, COLS - 1)];
+		}
+
+		rowDecisions = 0;
+		for (int row = 0; row < ROWS; row += 4)
+		{
+			rowDecisions |= simd::movemask(simd::float_4::load(draws + row) < simd::float_4::load(probabilities + row)) << row;
 		}
 	}
 
 	int getMatrixPosition(int row)
 	{
-		return 16 * row + rowStepIndex[row];
+		return COLS * row + rowStepIndex[row];
 	}
 
 	void calculateNextIndex()
 	{
-		for (int row = 0; row < 8; row++)
+		for (int row = 0; row < ROWS; row++)
+		{
+			// Steps outside the window, also after the window moved away, restart at its start
+			int next = rowStepIndex[row] + rowStepIncrement[row];
+			bool isInWindow = next >= 0 && next < COLS && ((windowMask[row] >> next) & 1);
+			rowStepIndex[row] = isInWindow ? next : rowStart[row];
+		}
+		decideSteps();
+		syncLink.steps++;
+
+		phase = 0.f;
+	}
+
+	/** Nudge button: rotates the loop window or the whole row and records it for undo */
+	void nudgeRow(int row, bool toLeft)
+	{
+		int start = nudgeModeInternal ? rowStart[row] : 0;
+		int end = nudgeModeInternal ? rowEnd[row] : COLS - 1;
+		if (end - start < 1)
+		{
+			return;
+		}
+
+		nudgeWindow(row, toLeft, start, end);
+		nudges.push({row, toLeft, start, end});
+	}
+
+	void nudgeWindow(int row, bool toLeft, int start, int end)
+	{
+		GS_TRACE_ZONE("GateMatrix nudge");
+
+		int length = end - start + 1;
+		if (length < 2)
+		{
+			return;
+		}
+
+		uint64_t windowMask = lowSteps(length) << start;
+		uint64_t window = rotateSteps((uint64_t)rowSteps[row] >> start, length, toLeft ? length - 1 : 1);
+		rowSteps[row] = (Steps)((rowSteps[row] & ~windowMask) | ((window << start) & windowMask));
+
+		// Probabilities and microtiming move with their steps
+		uint8_t *first = stepProbability[row] + start;
+		uint8_t *last = stepProbability[row] + end + 1;
+		std::rotate(first, toLeft ? first + 1 : last - 1, last);
+		first = stepMicrotiming[row] + start;
+		last = stepMicrotiming[row] + end + 1;
+		std::rotate(first, toLeft ? first + 1 : last - 1, last);
+		isTimingChanged = true;
+	}
+
+	/** External clocks jitter by a sample or so, periods this close to timingPeriod keep the delay table */
+	uint32_t getPeriodTolerance()
+	{
+		return timingPeriod / 128 + 1;
+	}
+
+	/** The time since the last clock edge, or the last period if the clock stopped in between */
+	uint32_t getMeasuredPeriod()
+	{
+		if (timingPeriod > 0 && samplesSinceClock / 2 > timingPeriod)
 		{
-			rowStepIndex[row] = rowStepIndex[row] + rowStepIncrement[row];
-			if (rowStepIndex[row] > (int)params[END_PARAM + row].getValue())
+			// The pause says nothing about the tempo
+			return timingPeriod;
+		}
+		return samplesSinceClock;
+	}
+
+	/** Starts the step that was just clocked. The delay table is only rebuilt when the step period or the timing settings change. */
+	void scheduleStep(uint32_t period)
+	{
+		uint32_t periodChange = period > timingPeriod ? period - timingPeriod : timingPeriod - period;
+		if (periodChange > getPeriodTolerance() || isTimingChanged)
+		{
+			GS_TRACE_ZONE("GateMatrix step delays");
+
+			timingPeriod = period;
+			isTimingChanged = false;
+			for (int y = 0; y < ROWS; y++)
 			{
-				rowStepIndex[row] = (int)params[START_PARAM + row].getValue();
+				int rowSwingPercent = clamp(swing + rowSwing[y], 0, MAX_DELAY);
+				for (int x = 0; x < COLS; x++)
+				{
+					// Swing delays every second step
+					int percent = std::min((x % 2 ? rowSwingPercent : 0) + stepMicrotiming[y][x], (int)MAX_DELAY);
+					stepDelay[y][x] = (uint32_t)((uint64_t)period * percent / 100);
+				}
 			}
 		}
 
-		phase = 0.f;
+		samplesSinceClock = 0;
+	}
+
+	/** Gates without delay follow the clock, delayed ones open for half a step */
+	bool isStepOpen(int row, bool gateIn)
+	{
+		uint32_t delay = stepDelay[row][rowStepIndex[row]];
+		if (delay == 0)
+		{
+			return gateIn;
+		}
+		// Close before the earliest next edge, so a gate delayed by half a step doesn't merge with the next one
+		uint32_t end = std::min(delay + timingPeriod / 2, timingPeriod - getPeriodTolerance() - 1);
+		return running && samplesSinceClock >= delay && samplesSinceClock < end;
+	}
+
+	int getEuclidKey(int row)
+	{
+		// 0-10V spans the whole row
+		const float stepsPerVolt = COLS * 0.1f;
+		int length = clamp(euclid[row].length + (int)roundf(inputs[EUCLID_LENGTH_INPUT].getPolyVoltage(row) * stepsPerVolt), 1, COLS);
+		int pulses = clamp(euclid[row].pulses + (int)roundf(inputs[EUCLID_PULSES_INPUT].getPolyVoltage(row) * stepsPerVolt), 0, length);
+		int rotation = eucMod(euclid[row].rotation + (int)roundf(inputs[EUCLID_ROTATION_INPUT].getPolyVoltage(row) * stepsPerVolt), length);
+		int start = rowStart[row];
+
+		return (start << 21) | (rotation << 14) | (pulses << 7) | length;
+	}
+
+	/** Knobs plus CV, 0-10V spans the whole row. Masks are only rebuilt when a window moves. */
+	void processWindows()
+	{
+		float knobs[2][ROWS];
+		for (int y = 0; y < ROWS; y++)
+		{
+			knobs[0][y] = params[START_PARAM + y].getValue();
+			knobs[1][y] = params[END_PARAM + y].getValue();
+		}
+
+		const float stepsPerVolt = COLS * 0.1f;
+		float starts[ROWS];
+		float ends[ROWS];
+		for (int y = 0; y < ROWS; y += 4)
+		{
+			simd::float_4 start = simd::float_4::load(knobs[0] + y) + inputs[START_INPUT].template getPolyVoltageSimd<simd::float_4>(y) * stepsPerVolt;
+			simd::float_4 end = simd::float_4::load(knobs[1] + y) + inputs[END_INPUT].template getPolyVoltageSimd<simd::float_4>(y) * stepsPerVolt;
+			simd::clamp(simd::round(start), 0.f, COLS - 1.f).store(starts + y);
+			simd::clamp(simd::round(end), 0.f, COLS - 1.f).store(ends + y);
+		}
+
+		for (int y = 0; y < ROWS; y++)
+		{
+			int start = (int)starts[y];
+			int end = (int)ends[y];
+			if (start != rowStart[y] || end != rowEnd[y])
+			{
+				rowStart[y] = start;
+				rowEnd[y] = end;
+				windowMask[y] = end >= start ? lowSteps(end - start + 1) << start : 0;
+			}
+		}
 	}
 
-	void nudgeRowLeft(int row)
+	/** Mutates the rows with a rising edge on their channel of the mutate input, four rows per vector */
+	void processMutation()
 	{
-		int start = row * 16;
-		int end = row * 16;
+		int triggered = 0;
+		for (int y = 0; y < ROWS; y += 4)
+		{
+			simd::float_4 edges = mutateTriggers[y / 4].process(inputs[MUTATE_INPUT].template getPolyVoltageSimd<simd::float_4>(y), 0.1f, 1.f);
+			triggered |= simd::movemask(edges) << y;
+		}
 
-		if (nudgeModeInternal)
+		for (int y = 0; triggered >> y; y++)
 		{
-			start += (int)params[START_PARAM + row].getValue();
-			end += (int)params[END_PARAM + row].getValue();
+			if ((triggered >> y) & 1)
+			{
+				mutateRow(y, inputs[MUTATION_CHANCE_INPUT].getPolyVoltage(y) * 10.f);
+			}
 		}
-		else
+	}
+
+	/** Shift register style mutation of the row's window, `chance` in percent. Works on the row word, no step loops. */
+	void mutateRow(int row, float chance)
+	{
+		uint64_t windowMask = this->windowMask[row];
+		if (mutationMode[row] == MUTATE_LOCK || !windowMask)
+		{
+			return;
+		}
+
+		int start = rowStart[row];
+		int length = rowEnd[row] - start + 1;
+		bool isFlipped = random::uniform() * 100.f < chance;
+		uint64_t window = ((uint64_t)rowSteps[row] & windowMask) >> start;
+		if (mutationMode[row] == MUTATE_SHIFT)
+		{
+			// The last step comes around as the first one
+			window = rotateSteps(window, length, 1) ^ (uint64_t)isFlipped;
+		}
+		else if (isFlipped)
+		{
+			window ^= 1ull << (random::u32() % length);
+		}
+		rowSteps[row] = (Steps)((rowSteps[row] & ~windowMask) | (window << start));
+	}
+
+	void processEuclid(int row)
+	{
+		int key = getEuclidKey(row);
+		if (key == euclid[row].lastKey)
+		{
+			return;
+		}
+		euclid[row].lastKey = key;
+
+		GS_TRACE_ZONE("GateMatrix euclid pattern");
+
+		int length = key & 0x7f;
+		int pulses = (key >> 7) & 0x7f;
+		int rotation = (key >> 14) & 0x7f;
+		int start = key >> 21;
+
+		// The pattern starts at the row's start step and wraps around the row
+		uint64_t pattern = rotateSteps(getEuclidMask(pulses, length), length, rotation);
+		rowSteps[row] = (Steps)rotateSteps(pattern, COLS, start);
+	}
+
+	/** Copies a PATTERN_GRID entry into the rows, cropping or padding it to the grid */
+	void loadPattern(const PatternLibrary *library, int entry)
+	{
+		if (!library || entry < 0 || entry >= library->getCount() || library->entries[entry].kind != PATTERN_GRID)
 		{
-			end += 15;
+			return;
 		}
 
-		bool tempValue = stepValue[start];
-		for (int i = start; i < end; i++)
+		GS_TRACE_ZONE("GateMatrix load pattern");
+
+		const PatternGrid *grid = (const PatternGrid *)library->getData(entry);
+		const uint64_t *steps = (const uint64_t *)(grid + 1);
+		const uint8_t *probabilities = (const uint8_t *)(steps + grid->rows);
+		int cols = std::min((int)grid->cols, COLS);
+		for (int y = 0; y < ROWS; y++)
 		{
-			stepValue[i] = stepValue[i + 1];
+			bool isInPattern = y < (int)grid->rows;
+			rowSteps[y] = isInPattern ? (Steps)(steps[y] & lowSteps(cols)) : 0;
+			for (int x = 0; x < COLS; x++)
+			{
+				stepProbability[y][x] = isInPattern && x < cols ? std::min(probabilities[y * grid->cols + x], (uint8_t)100) : 100;
+			}
+			// The loaded steps stand until the generator's inputs change
+			euclid[y].lastKey = getEuclidKey(y);
 		}
-		stepValue[end] = tempValue;
+
+		lastLibrary = library;
+		libraryPattern = entry;
 	}
 
-	void nudgeRowRight(int row)
+	/** 0-10V scrolls through the library's patterns with the selected tag */
+	void browseLibrary()
 	{
-		int start = row * 16;
-		int end = row * 16;
+		const PatternLibrary *library = PatternLibrary::current();
+		if (!library)
+		{
+			return;
+		}
 
-		if (nudgeModeInternal)
+		const std::vector<uint32_t> &patterns = library->getIndex(PATTERN_GRID, libraryTag);
+		int count = patterns.size();
+		if (count == 0)
 		{
-			start += (int)params[START_PARAM + row].getValue();
-			end += (int)params[END_PARAM + row].getValue();
+			return;
 		}
-		else
+
+		int selected = clamp((int)(inputs[LIBRARY_INPUT].getVoltage() * 0.1f * count), 0, count - 1);
+		if (library != lastLibrary || (int)patterns[selected] != libraryPattern)
 		{
-			end += 15;
+			loadPattern(library, patterns[selected]);
 		}
+	}
 
-		bool tempValue = stepValue[end];
-		for (int i = end; i > start; i--)
+	/** UI thread, the grid as a PATTERN_GRID record for PatternLibrary::save() */
+	PatternRecord makePatternRecord()
+	{
+		const LightState &state = lightSnapshot.read();
+		PatternRecord record;
+		record.kind = PATTERN_GRID;
+		PatternGrid grid = {ROWS, COLS};
+		record.data.resize(sizeof(PatternGrid) + ROWS * sizeof(uint64_t) + ((ROWS * COLS + 7) & ~7), 0);
+		std::memcpy(record.data.data(), &grid, sizeof(grid));
+		uint8_t *steps = record.data.data() + sizeof(PatternGrid);
+		for (int y = 0; y < ROWS; y++)
 		{
-			stepValue[i] = stepValue[i - 1];
+			uint64_t rowWord = state.rowSteps[y];
+			std::memcpy(steps + y * sizeof(uint64_t), &rowWord, sizeof(rowWord));
 		}
-		stepValue[start] = tempValue;
+		std::memcpy(steps + ROWS * sizeof(uint64_t), state.stepProbability, ROWS * COLS);
+		return record;
 	}
 
 	void process(const ProcessArgs &args) override
 	{
+		GS_PROFILE_PROCESS(model->slug.c_str());
+
+		Command command;
+		while (commands.pop(command))
+		{
+			applyCommand(command);
+		}
+
+		// Loop windows
+		processWindows();
+
+		const TransportMessage *transport = transportReceiver.read(this, args);
+		SyncClock syncClock;
+		bool isSyncFollower = syncLink.follow(id, args.frame, syncClock);
+
 		// Run
 		if (runningTrigger.process(rescale(params[RUN_PARAM].getValue(), 0.1f, 1.f, 0.f, 1.f)))
 		{
 			running = !running;
 		}
-		lights[RUNNING_LIGHT].value = (running);
 
 		bool gateIn = false;
+		// Advance of the internal clock, followers in the sync group extrapolate it
+		float phasePerFrame = 0.f;
 
 		if (running)
 		{
@@ -315,128 +1040,808 @@ struct Stable16 : Module
 				if (clockTrigger.process(rescale(inputs[EXT_CLOCK_INPUT].getVoltage(), 0.1f, 1.f, 0.f, 1.f)))
 				{
 					calculateNextIndex();
+					// The step lasts as long as the last one
+					scheduleStep(getMeasuredPeriod());
 				}
 				gateIn = clockTrigger.isHigh();
 			}
+			else if (transport)
+			{
+				// Seqtrol clock
+				if (transport->clockRise)
+				{
+					calculateNextIndex();
+					scheduleStep(getMeasuredPeriod());
+				}
+				gateIn = transport->clock;
+			}
+			else if (isSyncFollower)
+			{
+				// Sync group clock
+				if (syncClock.step)
+				{
+					calculateNextIndex();
+					scheduleStep(syncClock.period ? syncClock.period : getMeasuredPeriod());
+				}
+				phase = syncClock.phase;
+				gateIn = syncClock.gate;
+			}
 			else
 			{
 				// Internal clock
 				float clockTime = powf(2.0f, params[CLOCK_PARAM].getValue() + inputs[CLOCK_INPUT].getVoltage());
-				phase += clockTime * args.sampleTime;
+				phasePerFrame = clockTime * args.sampleTime;
+				phase += phasePerFrame;
 				if (phase >= 1.0f)
 				{
 					calculateNextIndex();
+					scheduleStep((uint32_t)(args.sampleRate / clockTime));
 				}
 				gateIn = (phase < 0.5f);
 			}
 		}
 
 		// Reset
-		if (resetTrigger.process(rescale(params[RESET_PARAM].getValue() + inputs[RESET_INPUT].getVoltage(), 0.1f, 1.f, 0.f, 1.f)))
+		bool transportReset = transport && transport->resetRise && !inputs[RESET_INPUT].isConnected();
+		bool syncReset = isSyncFollower && syncClock.reset && !inputs[RESET_INPUT].isConnected();
+		if (resetTrigger.process(rescale(params[RESET_PARAM].getValue() + inputs[RESET_INPUT].getVoltage(), 0.1f, 1.f, 0.f, 1.f)) || transportReset || syncReset)
 		{
 			resetStepIndices();
 		}
-
-		lights[RESET_LIGHT].setSmoothBrightness(resetTrigger.isHigh(), args.sampleTime * lightDivider.getDivision());
+		syncLink.publish(id, args.frame, phase, phasePerFrame, gateIn);
 
 		// Nudge mode
 		nudgeModeInternal = params[NUDGE_MODE_PARAM].getValue() == 1.f;
 
 		// Nudge
-		for (int y = 0; y < 8; y++)
+		for (int y = 0; y < ROWS; y++)
 		{
 			if (nudgeLeftTriggers[y].process(rescale(params[NUDGE_LEFT_PARAM + y].getValue(), 0.1f, 1.f, 0.f, 1.f)))
 			{
-				nudgeRowLeft(y);
+				nudgeRow(y, true);
 			}
 
 			if (nudgeRightTriggers[y].process(rescale(params[NUDGE_RIGHT_PARAM + y].getValue(), 0.1f, 1.f, 0.f, 1.f)))
 			{
-				nudgeRowRight(y);
+				nudgeRow(y, false);
 			}
 		}
 
-		// Steps
-		for (int i = 0; i < 128; i++)
+		// Pattern library
+		if (inputs[LIBRARY_INPUT].isConnected())
 		{
-			if (stepTrigger[i].process(params[STEP_PARAM + i].getValue()))
-			{
-				stepValue[i] = !stepValue[i];
-			}
+			browseLibrary();
+		}
 
-			lights[STEP_LIGHT + i].setSmoothBrightness(stepValue[i] ? 0.7f : 0.0f, args.sampleTime * lightDivider.getDivision());
+		// Mutation
+		if (inputs[MUTATE_INPUT].isConnected())
+		{
+			processMutation();
 		}
 
-		// Cursor Position
-		for (int y = 0; y < 8; y++)
+		// Euclidean generators
+		for (int y = 0; y < ROWS; y++)
 		{
-			int index = getMatrixPosition(y);
-			lights[STEP_LIGHT + index].setSmoothBrightness(stepValue[index] ? 1.f : 0.2f, args.sampleTime * lightDivider.getDivision());
+			if (euclid[y].enabled)
+			{
+				processEuclid(y);
+			}
 		}
 
 		// Outputs and mutes
-		for (int y = 0; y < 8; y++)
+		for (int y = 0; y < ROWS; y++)
 		{
 			mute[y] = params[MUTE_PARAM + y].getValue() == 1.f;
-			outputs[ROW_OUTPUT + y].setVoltage((gateIn && !mute[y] && stepValue[getMatrixPosition(y)]) ? 10.0f : 0.0f);
-			lights[ROW_LIGHTS + y].value = outputs[ROW_OUTPUT + y].value / 10.0f;
+			bool rowGate = isStepOpen(y, gateIn) && !mute[y] && getStep(y, rowStepIndex[y]) && ((rowDecisions >> y) & 1);
+			outputs[ROW_OUTPUT + y].setVoltage(rowGate ? 10.0f : 0.0f);
+			lightState.rowGates |= (uint32_t)rowGate << y;
 		}
 
-		lights[GATES_LIGHT].setSmoothBrightness(gateIn, args.sampleTime * lightDivider.getDivision());
+		if (samplesSinceClock < UINT32_MAX)
+		{
+			samplesSinceClock++;
+		}
+
+		// Short pulses are latched until the next snapshot
+		lightState.reset |= resetTrigger.isHigh() || transportReset;
+		lightState.gate |= gateIn;
+		if (lightDivider.process())
+		{
+			for (int y = 0; y < ROWS; y++)
+			{
+				lightState.rowSteps[y] = rowSteps[y];
+				lightState.rowStepIndex[y] = (uint8_t)rowStepIndex[y];
+			}
+			std::memcpy(lightState.stepProbability, stepProbability, sizeof(stepProbability));
+			lightState.running = running;
+			lightSnapshot.publish(lightState);
+
+			lightState.rowGates = 0;
+			lightState.reset = false;
+			lightState.gate = false;
+		}
 	}
 };
 
-struct Stable16Widget : ModuleWidget
+template <int ROWS, int COLS>
+struct GateMatrixWidget : ModuleWidget
 {
-	Stable16Widget(Stable16 *module)
+	typedef GateMatrix<ROWS, COLS> TModule;
+
+	/** Undo for step toggles: only the XOR of the row word before and after. Undo and redo both flip it. */
+	struct StepDiffAction : history::ModuleAction
+	{
+		int row;
+		uint64_t diff;
+
+		void flip()
+		{
+			TModule *module = dynamic_cast<TModule *>(APP->engine->getModule(moduleId));
+			if (module)
+			{
+				module->pushHistoryCommand(TModule::Command::TOGGLE_STEPS, row, 0, 0, diff);
+			}
+		}
+
+		void undo() override
+		{
+			flip();
+		}
+
+		void redo() override
+		{
+			flip();
+		}
+	};
+
+	/** Undo for "Randomize steps": the XOR of every row word before and after */
+	struct RandomizeAction : history::ModuleAction
+	{
+		uint64_t diffs[ROWS];
+
+		void flip()
+		{
+			TModule *module = dynamic_cast<TModule *>(APP->engine->getModule(moduleId));
+			if (!module)
+			{
+				return;
+			}
+			for (int y = 0; y < ROWS; y++)
+			{
+				if (diffs[y])
+				{
+					module->pushHistoryCommand(TModule::Command::TOGGLE_STEPS, y, 0, 0, diffs[y]);
+				}
+			}
+		}
+
+		void undo() override
+		{
+			flip();
+		}
+
+		void redo() override
+		{
+			flip();
+		}
+	};
+
+	/** Undo for the nudge buttons, rotates the same window back */
+	struct NudgeAction : history::ModuleAction
+	{
+		typename TModule::Nudge nudge;
+
+		void rotate(bool toLeft)
+		{
+			TModule *module = dynamic_cast<TModule *>(APP->engine->getModule(moduleId));
+			if (module)
+			{
+				module->pushHistoryCommand(TModule::Command::NUDGE_WINDOW, nudge.row, toLeft, nudge.start, nudge.end);
+			}
+		}
+
+		void undo() override
+		{
+			rotate(!nudge.toLeft);
+		}
+
+		void redo() override
+		{
+			rotate(nudge.toLeft);
+		}
+	};
+
+	/** All steps in one widget, so a grid costs one child instead of two per step.
+	 * Click toggles a step, shift-scroll or shift-drag sets its probability, ctrl-scroll its microtiming.
+	 * Plain scrolling sets the probability only with knob scrolling on. */
+	struct StepGrid : OpaqueWidget
+	{
+		TModule *module = nullptr;
+		float spacingX = 20.f;
+		float spacingY = 40.f;
+		bool isDraggingProbability = false;
+		int dragRow = 0;
+		int dragStep = 0;
+		float dragProbability = 0.f;
+
+		static constexpr float BUTTON_RADIUS = 7.f;
+		static constexpr float LIGHT_RADIUS = 4.5f;
+
+		/** Step under `pos`, false between the buttons */
+		bool getStepAt(Vec pos, int *row, int *step)
+		{
+			int x = (int)(pos.x / spacingX);
+			int y = (int)(pos.y / spacingY);
+			if (pos.x < 0.f || pos.y < 0.f || x >= COLS || y >= ROWS)
+			{
+				return false;
+			}
+
+			float dx = pos.x - (x + 0.5f) * spacingX;
+			float dy = pos.y - (y + 0.5f) * spacingY;
+			if (dx * dx + dy * dy > BUTTON_RADIUS * BUTTON_RADIUS)
+			{
+				return false;
+			}
+
+			*row = y;
+			*step = x;
+			return true;
+		}
+
+		void onButton(const event::Button &e) override
+		{
+			int row, step;
+			if (!module || e.button != GLFW_MOUSE_BUTTON_LEFT || !getStepAt(e.pos, &row, &step))
+			{
+				// Right clicks and clicks between the steps reach the module
+				Widget::onButton(e);
+				return;
+			}
+
+			OpaqueWidget::onButton(e);
+			if (e.action != GLFW_PRESS)
+			{
+				return;
+			}
+
+			isDraggingProbability = (e.mods & RACK_MOD_MASK) == GLFW_MOD_SHIFT;
+			if (isDraggingProbability)
+			{
+				dragRow = row;
+				dragStep = step;
+				dragProbability = module->stepProbability[row][step];
+				return;
+			}
+			uint64_t diff = 1ull << step;
+			if (!module->pushCommand(TModule::Command::TOGGLE_STEPS, row, 0, 0, diff))
+			{
+				return;
+			}
+
+			StepDiffAction *action = new StepDiffAction;
+			action->name = "toggle step";
+			action->moduleId = module->id;
+			action->row = row;
+			action->diff = diff;
+			APP->history->push(action);
+		}
+
+		void onHoverScroll(const event::HoverScroll &e) override
+		{
+			int row, step;
+			if (!module || !getStepAt(e.pos, &row, &step))
+			{
+				OpaqueWidget::onHoverScroll(e);
+				return;
+			}
+
+			int delta = e.scrollDelta.y > 0.f ? 5 : -5;
+			int mods = APP->window->getMods() & RACK_MOD_MASK;
+			if (mods == RACK_MOD_CTRL)
+			{
+				module->pushCommand(TModule::Command::SET_MICROTIMING, row, clamp(module->stepMicrotiming[row][step] + delta, 0, (int)TModule::MAX_DELAY), step);
+			}
+			else if (settings::knobScroll || mods == GLFW_MOD_SHIFT)
+			{
+				module->pushCommand(TModule::Command::SET_PROBABILITY, row, clamp(module->stepProbability[row][step] + delta, 0, 100), step);
+			}
+			else
+			{
+				// Like the knobs, a plain scroll scrolls the rack unless knob scrolling is on
+				OpaqueWidget::onHoverScroll(e);
+				return;
+			}
+			e.consume(this);
+		}
+
+		void onDragMove(const event::DragMove &e) override
+		{
+			if (isDraggingProbability)
+			{
+				// Half a percent per pixel, dragging up raises it
+				dragProbability = clamp(dragProbability - e.mouseDelta.y * 0.5f, 0.f, 100.f);
+				module->pushCommand(TModule::Command::SET_PROBABILITY, dragRow, (int)roundf(dragProbability), dragStep);
+			}
+		}
+
+		void onDragEnd(const event::DragEnd &e) override
+		{
+			isDraggingProbability = false;
+		}
+
+		void draw(const DrawArgs &args) override
+		{
+			for (int y = 0; y < ROWS; y++)
+			{
+				for (int x = 0; x < COLS; x++)
+				{
+					float centerX = (x + 0.5f) * spacingX;
+					float centerY = (y + 0.5f) * spacingY;
+
+					nvgBeginPath(args.vg);
+					nvgCircle(args.vg, centerX, centerY, BUTTON_RADIUS);
+					nvgFillColor(args.vg, nvgRGB(0x2a, 0x2a, 0x2a));
+					nvgFill(args.vg);
+
+					nvgBeginPath(args.vg);
+					nvgCircle(args.vg, centerX, centerY, LIGHT_RADIUS);
+					nvgFillColor(args.vg, nvgRGB(0x14, 0x14, 0x14));
+					nvgFill(args.vg);
+				}
+			}
+		}
+
+		/** Lit steps go on the light layer like LightWidget, so the room brightness doesn't dim them */
+		void drawLayer(const DrawArgs &args, int layer) override
+		{
+			// The browser preview has no module and shows the grid unlit
+			if (layer != 1 || !module)
+			{
+				OpaqueWidget::drawLayer(args, layer);
+				return;
+			}
+
+			nvgGlobalCompositeBlendFunc(args.vg, NVG_ONE_MINUS_DST_COLOR, NVG_ONE);
+			float haloRadius = LIGHT_RADIUS + std::min(LIGHT_RADIUS * 4.f, 15.f);
+			for (int y = 0; y < ROWS; y++)
+			{
+				for (int x = 0; x < COLS; x++)
+				{
+					float brightness = std::min(module->lights[TModule::STEP_LIGHT + x + COLS * y].getBrightness(), 1.f);
+					if (brightness <= 0.f)
+					{
+						continue;
+					}
+
+					float centerX = (x + 0.5f) * spacingX;
+					float centerY = (y + 0.5f) * spacingY;
+					nvgBeginPath(args.vg);
+					nvgCircle(args.vg, centerX, centerY, LIGHT_RADIUS);
+					nvgFillColor(args.vg, nvgRGBAf(0.565f, 0.988f, 0.451f, brightness));
+					nvgFill(args.vg);
+
+					// Screenshots and framebuffers get no halo, as with Rack's lights
+					if (args.fb || settings::haloBrightness <= 0.f)
+					{
+						continue;
+					}
+					nvgBeginPath(args.vg);
+					nvgRect(args.vg, centerX - haloRadius, centerY - haloRadius, 2.f * haloRadius, 2.f * haloRadius);
+					NVGcolor innerColor = nvgRGBAf(0.565f, 0.988f, 0.451f, brightness * settings::haloBrightness);
+					nvgFillPaint(args.vg, nvgRadialGradient(args.vg, centerX, centerY, LIGHT_RADIUS, haloRadius, innerColor, nvgRGBA(0, 0, 0, 0)));
+					nvgFill(args.vg);
+				}
+			}
+			OpaqueWidget::drawLayer(args, layer);
+		}
+	};
+
+	/** Start/end knob for grids with 20 px rows */
+	struct TrimpotSnap : Trimpot
 	{
+		TrimpotSnap()
+		{
+			snap = true;
+		}
+	};
+
+	GateMatrixWidget(TModule *module)
+	{
+		static const std::string slug = ROWS == 8 && COLS == 16 ? "Stable16" : string::f("Stable%dx%d", ROWS, COLS);
+		GS_PROFILE_WIDGET(slug.c_str());
+
 		setModule(module);
-		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/Stable16.svg")));
+		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/" + slug + ".svg")));
 
 		addChild(createWidget<ScrewSilver>(Vec(15, 0)));
 		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 30, 0)));
 		addChild(createWidget<ScrewSilver>(Vec(15, 365)));
 		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 30, 365)));
 
-		static const float stepGridX[16] = {20, 40, 60, 80, 100, 120, 140, 160, 180, 200, 220, 240, 260, 280, 300, 320};
-		static const float stepGridY[8] = {64, 104, 144, 184, 224, 264, 304, 344};
-		static const float gatesOutX = 372.0f;
-		static const float startKnobsX = 412.0f;
-		static const float endKnobsX = 452.0f;
-		static const float nudgeLeftButtonX = 532.0f - 8.0f;
-		static const float nudgeRightButtonX = 532.0f + 8.0f;
+		// Stable16 layout: 20 px steps, 40 px rows. Larger grids squeeze both.
+		const bool isDense = ROWS > 8;
+		const float stepSpacingX = COLS > 32 ? 16.f : 20.f;
+		const float rowSpacingY = isDense ? 20.f : 40.f;
+		const float gridTop = isDense ? 44.f : 64.f;
+		const float gridRight = 20.f + (COLS - 1) * stepSpacingX;
+
+		const float gatesOutX = gridRight + 52.0f;
+		const float startKnobsX = gridRight + 92.0f;
+		const float endKnobsX = gridRight + 132.0f;
+		const float nudgeLeftButtonX = gridRight + 212.0f - 8.0f;
+		const float nudgeRightButtonX = gridRight + 212.0f + 8.0f;
+
+		StepGrid *stepGrid = createWidget<StepGrid>(Vec(20.f - stepSpacingX / 2, gridTop - rowSpacingY / 2));
+		stepGrid->box.size = Vec(COLS * stepSpacingX, ROWS * rowSpacingY);
+		stepGrid->module = module;
+		stepGrid->spacingX = stepSpacingX;
+		stepGrid->spacingY = rowSpacingY;
+		addChild(stepGrid);
+
+		for (int y = 0; y < ROWS; y++)
+		{
+			float rowY = gridTop + y * rowSpacingY;
+			// Jacks don't fit into 20 px rows, odd rows move right
+			float outX = isDense ? gatesOutX - 6.f + (y % 2) * 22.f : gatesOutX;
+			float muteX = isDense ? gatesOutX - 30.f : gatesOutX - 27.f;
+			addOutput(createOutputCentered<PJ301MPort>(Vec(outX, rowY), module, TModule::ROW_OUTPUT + y));
+			addParam(createParamCentered<SquareSwitch>(Vec(muteX, rowY), module, TModule::MUTE_PARAM + y));
+			addChild(createLightCentered<MediumLight<GreenLight>>(Vec(muteX, rowY), module, TModule::ROW_LIGHTS + y));
+
+			if (isDense)
+			{
+				addParam(createParamCentered<TrimpotSnap>(Vec(startKnobsX, rowY), module, TModule::START_PARAM + y));
+				addParam(createParamCentered<TrimpotSnap>(Vec(endKnobsX, rowY), module, TModule::END_PARAM + y));
+			}
+			else
+			{
+				addParam(createParamCentered<RoundBlackSnapKnob>(Vec(startKnobsX, rowY), module, TModule::START_PARAM + y));
+				addParam(createParamCentered<RoundBlackSnapKnob>(Vec(endKnobsX, rowY), module, TModule::END_PARAM + y));
+			}
+
+			addParam(createParamCentered<ArrowLeft>(Vec(nudgeLeftButtonX, rowY), module, TModule::NUDGE_LEFT_PARAM + y));
+			addParam(createParamCentered<ArrowRight>(Vec(nudgeRightButtonX, rowY), module, TModule::NUDGE_RIGHT_PARAM + y));
+		}
+
+		static const float controlY[8] = {64, 104, 144, 184, 224, 264, 304, 344};
+		const float othersX = gridRight + 172.0f;
+		addParam(createParamCentered<Rogan1PGreen>(Vec(othersX, controlY[0]), module, TModule::CLOCK_PARAM));
+		addInput(createInputCentered<PJ301MPort>(Vec(othersX, controlY[1]), module, TModule::CLOCK_INPUT));
+		addInput(createInputCentered<PJ301MPort>(Vec(othersX, controlY[2]), module, TModule::EXT_CLOCK_INPUT));
+		addChild(createLightCentered<MediumLight<GreenLight>>(Vec(othersX, controlY[3]), module, TModule::GATES_LIGHT));
+		addParam(createParamCentered<LEDButton>(Vec(othersX, controlY[4]), module, TModule::RUN_PARAM));
+		addChild(createLightCentered<MediumLight<GreenLight>>(Vec(othersX, controlY[4]), module, TModule::RUNNING_LIGHT));
+		addParam(createParamCentered<LEDButton>(Vec(othersX, controlY[5]), module, TModule::RESET_PARAM));
+		addChild(createLightCentered<MediumLight<GreenLight>>(Vec(othersX, controlY[5]), module, TModule::RESET_LIGHT));
+		addInput(createInputCentered<PJ301MPort>(Vec(othersX, controlY[6]), module, TModule::RESET_INPUT));
+		addParam(createParamCentered<CKSS>(Vec(othersX, controlY[7]), module, TModule::NUDGE_MODE_PARAM));
+
+		const float cvInputsX = gridRight + 287.5f;
+		addInput(createInputCentered<PJ301MPort>(Vec(cvInputsX, controlY[0]), module, TModule::EUCLID_PULSES_INPUT));
+		addInput(createInputCentered<PJ301MPort>(Vec(cvInputsX, controlY[1]), module, TModule::EUCLID_LENGTH_INPUT));
+		addInput(createInputCentered<PJ301MPort>(Vec(cvInputsX, controlY[2]), module, TModule::EUCLID_ROTATION_INPUT));
+		addInput(createInputCentered<PJ301MPort>(Vec(cvInputsX, controlY[3]), module, TModule::START_INPUT));
+		addInput(createInputCentered<PJ301MPort>(Vec(cvInputsX, controlY[4]), module, TModule::END_INPUT));
+		addInput(createInputCentered<PJ301MPort>(Vec(cvInputsX, controlY[5]), module, TModule::MUTATE_INPUT));
+		addInput(createInputCentered<PJ301MPort>(Vec(cvInputsX, controlY[6]), module, TModule::MUTATION_CHANCE_INPUT));
+		addInput(createInputCentered<PJ301MPort>(Vec(cvInputsX, controlY[7]), module, TModule::LIBRARY_INPUT));
+	}
+
+	void step() override
+	{
+		TModule *module = dynamic_cast<TModule *>(this->module);
+		if (module)
+		{
+			module->flushHistoryCommands();
+
+			typename TModule::Nudge nudge;
+			while (module->nudges.pop(nudge))
+			{
+				NudgeAction *action = new NudgeAction;
+				action->name = "nudge row";
+				action->moduleId = module->id;
+				action->nudge = nudge;
+				APP->history->push(action);
+			}
+
+			const typename TModule::LightState &state = module->lightSnapshot.read();
+			float deltaTime = APP->window->getLastFrameDuration();
+
+			for (int i = 0; i < ROWS * COLS; i++)
+			{
+				bool step = (state.rowSteps[i / COLS] >> (i % COLS)) & 1;
+				bool isCursor = state.rowStepIndex[i / COLS] == i % COLS;
+				// Steps that don't always play are dimmer
+				float probability = state.stepProbability[i / COLS][i % COLS] * 0.01f;
+				module->lights[TModule::STEP_LIGHT + i].setSmoothBrightness(isCursor ? (step ? 1.f : 0.2f) : (step ? 0.7f * (0.25f + 0.75f * probability) : 0.0f), deltaTime);
+			}
+
+			for (int y = 0; y < ROWS; y++)
+			{
+				module->lights[TModule::ROW_LIGHTS + y].value = (state.rowGates >> y) & 1;
+			}
+
+			module->lights[TModule::RUNNING_LIGHT].value = state.running;
+			module->lights[TModule::RESET_LIGHT].setSmoothBrightness(state.reset, deltaTime);
+			module->lights[TModule::GATES_LIGHT].setSmoothBrightness(state.gate, deltaTime);
+		}
+
+		ModuleWidget::step();
+	}
+
+	void appendContextMenu(Menu *menu) override
+	{
+		TModule *module = dynamic_cast<TModule *>(this->module);
+
+		struct EuclidEnabledItem : MenuItem
+		{
+			TModule *module;
+			int row;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(TModule::Command::SET_EUCLID_ENABLED, row, !module->euclid[row].enabled);
+			}
+		};
+
+		struct EuclidValueItem : MenuItem
+		{
+			TModule *module;
+			int row;
+			typename TModule::Command::Type commandType;
+			int value;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(commandType, row, value);
+			}
+		};
+
+		struct EuclidValueMenuItem : MenuItem
+		{
+			TModule *module;
+			int row;
+			typename TModule::Command::Type commandType;
+			int *current;
+			int minValue;
+			int maxValue;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+				for (int i = minValue; i <= maxValue; i++)
+				{
+					EuclidValueItem *valueItem = createMenuItem<EuclidValueItem>(string::f("%d", i));
+					valueItem->rightText = CHECKMARK(*current == i);
+					valueItem->module = module;
+					valueItem->row = row;
+					valueItem->commandType = commandType;
+					valueItem->value = i;
+					menu->addChild(valueItem);
+				}
+				return menu;
+			}
+		};
+
+		struct EuclidRowMenuItem : MenuItem
+		{
+			TModule *module;
+			int row;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+
+				EuclidEnabledItem *enabledItem = createMenuItem<EuclidEnabledItem>("Enabled");
+				enabledItem->rightText = CHECKMARK(module->euclid[row].enabled);
+				enabledItem->module = module;
+				enabledItem->row = row;
+				menu->addChild(enabledItem);
+
+				EuclidValueMenuItem *pulsesItem = createMenuItem<EuclidValueMenuItem>("Pulses", RIGHT_ARROW);
+				pulsesItem->module = module;
+				pulsesItem->row = row;
+				pulsesItem->commandType = TModule::Command::SET_EUCLID_PULSES;
+				pulsesItem->current = &module->euclid[row].pulses;
+				pulsesItem->minValue = 0;
+				pulsesItem->maxValue = COLS;
+				menu->addChild(pulsesItem);
+
+				EuclidValueMenuItem *lengthItem = createMenuItem<EuclidValueMenuItem>("Length", RIGHT_ARROW);
+				lengthItem->module = module;
+				lengthItem->row = row;
+				lengthItem->commandType = TModule::Command::SET_EUCLID_LENGTH;
+				lengthItem->current = &module->euclid[row].length;
+				lengthItem->minValue = 1;
+				lengthItem->maxValue = COLS;
+				menu->addChild(lengthItem);
+
+				EuclidValueMenuItem *rotationItem = createMenuItem<EuclidValueMenuItem>("Rotation", RIGHT_ARROW);
+				rotationItem->module = module;
+				rotationItem->row = row;
+				rotationItem->commandType = TModule::Command::SET_EUCLID_ROTATION;
+				rotationItem->current = &module->euclid[row].rotation;
+				rotationItem->minValue = 0;
+				rotationItem->maxValue = COLS - 1;
+				menu->addChild(rotationItem);
+
+				return menu;
+			}
+		};
+
+		struct RandomizeStepsItem : MenuItem
+		{
+			TModule *module;
+			void onAction(const event::Action &e) override
+			{
+				// Any steps XORed with random words are random, so a slightly old snapshot does
+				const typename TModule::LightState &state = module->lightSnapshot.read();
+				RandomizeAction *action = new RandomizeAction;
+				action->name = "randomize steps";
+				action->moduleId = module->id;
+				for (int y = 0; y < ROWS; y++)
+				{
+					uint64_t steps = 0;
+					for (int x = 0; x < COLS; x++)
+					{
+						if (random::uniform() > 0.5f)
+						{
+							steps |= 1ull << x;
+						}
+					}
+					action->diffs[y] = steps ^ (uint64_t)state.rowSteps[y];
+				}
+				action->redo();
+				APP->history->push(action);
+			}
+		};
+
+		menu->addChild(new MenuEntry);
+		RandomizeStepsItem *randomizeItem = createMenuItem<RandomizeStepsItem>("Randomize steps");
+		randomizeItem->module = module;
+		menu->addChild(randomizeItem);
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Timing"));
 
-		for (int y = 0; y < 8; y++)
+		struct SwingItem : MenuItem
 		{
-			for (int x = 0; x < 16; x++)
+			TModule *module;
+			int row;
+			typename TModule::Command::Type commandType;
+			int value;
+			void onAction(const event::Action &e) override
 			{
-				addParam(createParamCentered<LEDButton>(Vec(stepGridX[x], stepGridY[y]), module, Stable16::STEP_PARAM + x + 16 * y));
-				addChild(createLightCentered<MediumLight<GreenLight>>(Vec(stepGridX[x], stepGridY[y]), module, Stable16::STEP_LIGHT + x + 16 * y));
+				module->pushCommand(commandType, row, value);
 			}
+		};
 
-			addOutput(createOutputCentered<PJ301MPort>(Vec(gatesOutX, stepGridY[y]), module, Stable16::ROW_OUTPUT + y));
-			addParam(createParamCentered<SquareSwitch>(Vec(gatesOutX - 27.f, stepGridY[y]), module, Stable16::MUTE_PARAM + y));
-			addChild(createLightCentered<MediumLight<GreenLight>>(Vec(gatesOutX - 27.f, stepGridY[y]), module, Stable16::ROW_LIGHTS + y));
+		struct SwingMenuItem : MenuItem
+		{
+			TModule *module;
+			int row;
+			typename TModule::Command::Type commandType;
+			int *current;
+			int minValue;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+				for (int i = minValue; i <= TModule::MAX_DELAY; i += 5)
+				{
+					SwingItem *swingItem = createMenuItem<SwingItem>(string::f(minValue < 0 ? "%+d%%" : "%d%%", i));
+					swingItem->rightText = CHECKMARK(*current == i);
+					swingItem->module = module;
+					swingItem->row = row;
+					swingItem->commandType = commandType;
+					swingItem->value = i;
+					menu->addChild(swingItem);
+				}
+				return menu;
+			}
+		};
 
-			addParam(createParamCentered<RoundBlackSnapKnob>(Vec(startKnobsX, stepGridY[y]), module, Stable16::START_PARAM + y));
-			addParam(createParamCentered<RoundBlackSnapKnob>(Vec(endKnobsX, stepGridY[y]), module, Stable16::END_PARAM + y));
+		struct RowSwingMenuItem : MenuItem
+		{
+			TModule *module;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+				for (int y = 0; y < ROWS; y++)
+				{
+					SwingMenuItem *rowItem = createMenuItem<SwingMenuItem>(string::f("Row %d", y + 1), RIGHT_ARROW);
+					rowItem->module = module;
+					rowItem->row = y;
+					rowItem->commandType = TModule::Command::SET_ROW_SWING;
+					rowItem->current = &module->rowSwing[y];
+					rowItem->minValue = -TModule::MAX_DELAY;
+					menu->addChild(rowItem);
+				}
+				return menu;
+			}
+		};
+
+		SwingMenuItem *swingItem = createMenuItem<SwingMenuItem>("Swing", RIGHT_ARROW);
+		swingItem->module = module;
+		swingItem->row = 0;
+		swingItem->commandType = TModule::Command::SET_SWING;
+		swingItem->current = &module->swing;
+		swingItem->minValue = 0;
+		menu->addChild(swingItem);
+
+		RowSwingMenuItem *rowSwingItem = createMenuItem<RowSwingMenuItem>("Row swing", RIGHT_ARROW);
+		rowSwingItem->module = module;
+		menu->addChild(rowSwingItem);
 
-			addParam(createParamCentered<ArrowLeft>(Vec(nudgeLeftButtonX, stepGridY[y]), module, Stable16::NUDGE_LEFT_PARAM + y));
-			addParam(createParamCentered<ArrowRight>(Vec(nudgeRightButtonX, stepGridY[y]), module, Stable16::NUDGE_RIGHT_PARAM + y));
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Mutation"));
+
+		struct MutationModeItem : MenuItem
+		{
+			TModule *module;
+			int row;
+			int mutationMode;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(TModule::Command::SET_MUTATION_MODE, row, mutationMode);
+			}
+		};
+
+		struct MutationMenuItem : MenuItem
+		{
+			TModule *module;
+			int row;
+			Menu *createChildMenu() override
+			{
+				Menu *menu = new Menu;
+				std::string mutationModeNames[TModule::NUM_MUTATION_MODES] = {"Shift", "Flip", "Lock"};
+				for (int i = 0; i < TModule::NUM_MUTATION_MODES; i++)
+				{
+					MutationModeItem *modeItem = createMenuItem<MutationModeItem>(mutationModeNames[i]);
+					modeItem->rightText = CHECKMARK(module->mutationMode[row] == i);
+					modeItem->module = module;
+					modeItem->row = row;
+					modeItem->mutationMode = i;
+					menu->addChild(modeItem);
+				}
+				return menu;
+			}
+		};
+
+		for (int y = 0; y < ROWS; y++)
+		{
+			MutationMenuItem *rowItem = createMenuItem<MutationMenuItem>(string::f("Row %d", y + 1), RIGHT_ARROW);
+			rowItem->module = module;
+			rowItem->row = y;
+			menu->addChild(rowItem);
 		}
 
-		static const float othersX = 492;
-		addParam(createParamCentered<Rogan1PGreen>(Vec(othersX, stepGridY[0]), module, Stable16::CLOCK_PARAM));
-		addInput(createInputCentered<PJ301MPort>(Vec(othersX, stepGridY[1]), module, Stable16::CLOCK_INPUT));
-		addInput(createInputCentered<PJ301MPort>(Vec(othersX, stepGridY[2]), module, Stable16::EXT_CLOCK_INPUT));
-		addChild(createLightCentered<MediumLight<GreenLight>>(Vec(othersX, stepGridY[3]), module, Stable16::GATES_LIGHT));
-		addParam(createParamCentered<LEDButton>(Vec(othersX, stepGridY[4]), module, Stable16::RUN_PARAM));
-		addChild(createLightCentered<MediumLight<GreenLight>>(Vec(othersX, stepGridY[4]), module, Stable16::RUNNING_LIGHT));
-		addParam(createParamCentered<LEDButton>(Vec(othersX, stepGridY[5]), module, Stable16::RESET_PARAM));
-		addChild(createLightCentered<MediumLight<GreenLight>>(Vec(othersX, stepGridY[5]), module, Stable16::RESET_LIGHT));
-		addInput(createInputCentered<PJ301MPort>(Vec(othersX, stepGridY[6]), module, Stable16::RESET_INPUT));
-		addParam(createParamCentered<CKSS>(Vec(othersX, stepGridY[7]), module, Stable16::NUDGE_MODE_PARAM));
+		menu->addChild(new MenuEntry);
+		PatternLibraryMenuItem *libraryItem = createMenuItem<PatternLibraryMenuItem>("Pattern library", RIGHT_ARROW);
+		libraryItem->kind = PATTERN_GRID;
+		libraryItem->tag = module->libraryTag;
+		libraryItem->loaded = module->lastLibrary == PatternLibrary::current() ? module->libraryPattern : -1;
+		libraryItem->loadPattern = [=](const PatternLibrary *library, int entry) { module->pushCommand(TModule::Command::LOAD_PATTERN, 0, entry, 0, (uintptr_t)library); };
+		libraryItem->setTag = [=](int tag) { module->pushCommand(TModule::Command::SET_LIBRARY_TAG, 0, tag); };
+		libraryItem->makeRecord = [=]() { return module->makePatternRecord(); };
+		menu->addChild(libraryItem);
+
+		SyncGroupMenuItem *syncItem = createMenuItem<SyncGroupMenuItem>("Sync group", RIGHT_ARROW);
+		syncItem->setGroup = [=](int group, bool lead) { module->pushCommand(TModule::Command::SET_SYNC_GROUP, 0, group, lead); };
+		syncItem->group = module->syncLink.group.load();
+		syncItem->isLeader = module->syncLink.isLeader(module->id);
+		menu->addChild(syncItem);
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Euclidean generators"));
+
+		for (int y = 0; y < ROWS; y++)
+		{
+			EuclidRowMenuItem *rowItem = createMenuItem<EuclidRowMenuItem>(string::f("Row %d", y + 1), RIGHT_ARROW);
+			rowItem->module = module;
+			rowItem->row = y;
+			menu->addChild(rowItem);
+		}
 	}
 };
 
-Model *modelStable16 = createModel<Stable16, Stable16Widget>("Stable16");
+Model *modelStable16 = createModel<GateMatrix<8, 16>, GateMatrixWidget<8, 16>>("Stable16");
+Model *modelStable4x16 = createModel<GateMatrix<4, 16>, GateMatrixWidget<4, 16>>("Stable4x16");
+Model *modelStable8x32 = createModel<GateMatrix<8, 32>, GateMatrixWidget<8, 32>>("Stable8x32");
+Model *modelStable16x64 = createModel<GateMatrix<16, 64>, GateMatrixWidget<16, 64>>("Stable16x64");
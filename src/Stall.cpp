@@ -1,4 +1,5 @@
 #include "plugin.hpp"
+#include "notes.hpp"
 
 struct Stall : Module
 {
@@ -24,14 +25,19 @@ struct Stall : Module
 	};
 
 	float cvStep[48];
+	/** Inputs of the last evaluation, the gate outputs hold while these don't change */
+	float lastCv[16] = {};
+	float lastGate[16] = {};
+	int lastChannels = -1;
+	/** Bit i is set while gate output i is high, for StallWidget::step() */
+	std::atomic<uint64_t> lightState{0};
 
 	Stall()
 	{
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
-		const float oneTwelfth = 1.0 / 12.0;
-		for (int i = 0; i < 48; i++)
+		for (int i = 0; i < STALL_NOTES; i++)
 		{
-			cvStep[i] = (float)(i - 25) * oneTwelfth;
+			cvStep[i] = getStallNoteCv(i);
 		}
 	}
 
@@ -51,26 +57,40 @@ struct Stall : Module
 
 	void process(const ProcessArgs &args) override
 	{
-		float gateOuts[48] = {0};
+		GS_PROFILE_PROCESS("Stall");
 
-		int channels = std::max(inputs[CV_IN].getChannels(), 1);
+		bool isPatched = inputs[CV_IN].isConnected() && inputs[GATE_IN].isConnected();
+		int channels = isPatched ? std::max(inputs[CV_IN].getChannels(), 1) : 0;
 
+		bool isSteady = channels == lastChannels;
 		for (int c = 0; c < channels; c++)
 		{
-			if (inputs[CV_IN].isConnected() && inputs[GATE_IN].isConnected())
-			{
-				float cv = inputs[CV_IN].getPolyVoltage(c);
-				float gate = inputs[GATE_IN].getPolyVoltage(c);
+			float cv = inputs[CV_IN].getPolyVoltage(c);
+			float gate = inputs[GATE_IN].getPolyVoltage(c);
+			isSteady = isSteady && cv == lastCv[c] && gate == lastGate[c];
+			lastCv[c] = cv;
+			lastGate[c] = gate;
+		}
+		lastChannels = channels;
 
-				gateOuts[getNoteNumberFromCv(cv)] = gate;
-			}
+		if (isSteady)
+		{
+			return;
+		}
+
+		float gateOuts[48] = {0};
+		for (int c = 0; c < channels; c++)
+		{
+			gateOuts[getNoteNumberFromCv(lastCv[c])] = lastGate[c];
 		}
 
+		uint64_t gates = 0;
 		for (int i = 0; i < 48; i++)
 		{
 			outputs[GATE_OUT + i].setVoltage(gateOuts[i]);
-			lights[GATE_LIGHT + i].value = outputs[GATE_OUT + i].value / 10.0f;
+			gates |= (uint64_t)(gateOuts[i] >= 1.f) << i;
 		}
+		lightState.store(gates, std::memory_order_relaxed);
 	}
 };
 
@@ -78,6 +98,8 @@ struct StallWidget : ModuleWidget
 {
 	StallWidget(Stall *module)
 	{
+		GS_PROFILE_WIDGET("Stall");
+
 		setModule(module);
 		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/Stall.svg")));
 
@@ -102,6 +124,20 @@ struct StallWidget : ModuleWidget
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(7.586, outGridY[5])), module, Stall::CV_IN));
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(7.586, outGridY[4])), module, Stall::GATE_IN));
 	}
+
+	void step() override
+	{
+		if (module)
+		{
+			uint64_t gates = dynamic_cast<Stall *>(module)->lightState.load(std::memory_order_relaxed);
+			for (int i = 0; i < 48; i++)
+			{
+				module->lights[Stall::GATE_LIGHT + i].value = (gates >> i) & 1;
+			}
+		}
+
+		ModuleWidget::step();
+	}
 };
 
 Model *modelStall = createModel<Stall, StallWidget>("Stall");
\ No newline at end of file
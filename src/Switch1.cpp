@@ -1,4 +1,5 @@
 #include "plugin.hpp"
+#include "transport.hpp"
 
 struct Switch1 : Module
 {
@@ -30,10 +31,19 @@ struct Switch1 : Module
 	dsp::SchmittTrigger t2Trigger;
 
 	int switchPosition = 0;
+	/** Trigger input levels of the last sample, the triggers only need to run when these change.
+	Levels are never negative, so the first sample always runs them. */
+	float lastT1Level = -1.f;
+	float lastT2Level = -1.f;
+	/** Running state from a Seqtrol on the left */
+	TransportReceiver transportReceiver;
+	/** switchPosition for Switch1Widget::step() */
+	std::atomic<int> lightState{0};
 
 	Switch1()
 	{
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		transportReceiver.attach(this);
 	}
 
 	void onReset() override
@@ -57,20 +67,36 @@ struct Switch1 : Module
 
 	void process(const ProcessArgs &args) override
 	{
-		if (t2Trigger.process(rescale(fabs(inputs[TRIGGER_IN_3].getVoltage()) + fabs(inputs[TRIGGER_IN_4].getVoltage()), 0.1f, 2.f, 0.f, 1.f)))
+		GS_PROFILE_PROCESS("Switch1");
+
+		// Without trigger cables a Seqtrol on the left switches: input 2 while running, input 1 while stopped
+		const TransportMessage *transport = transportReceiver.read(this, args);
+		if (transport && !inputs[TRIGGER_IN_1].isConnected() && !inputs[TRIGGER_IN_2].isConnected() && !inputs[TRIGGER_IN_3].isConnected() && !inputs[TRIGGER_IN_4].isConnected())
 		{
-			switchPosition = 1;
+			switchPosition = transport->running;
 		}
 
-		if (t1Trigger.process(rescale(fabs(inputs[TRIGGER_IN_1].getVoltage()) + fabs(inputs[TRIGGER_IN_2].getVoltage()), 0.1f, 2.f, 0.f, 1.f)))
+		float t1Level = fabs(inputs[TRIGGER_IN_1].getVoltage()) + fabs(inputs[TRIGGER_IN_2].getVoltage());
+		float t2Level = fabs(inputs[TRIGGER_IN_3].getVoltage()) + fabs(inputs[TRIGGER_IN_4].getVoltage());
+		if (t1Level != lastT1Level || t2Level != lastT2Level)
 		{
-			switchPosition = 0;
+			if (t2Trigger.process(rescale(t2Level, 0.1f, 2.f, 0.f, 1.f)))
+			{
+				switchPosition = 1;
+			}
+
+			if (t1Trigger.process(rescale(t1Level, 0.1f, 2.f, 0.f, 1.f)))
+			{
+				switchPosition = 0;
+			}
+
+			lastT1Level = t1Level;
+			lastT2Level = t2Level;
 		}
 
 		outputs[OUTPUT].setVoltage(inputs[INPUT + switchPosition].getVoltage());
 
-		lights[LIGHT + switchPosition].setSmoothBrightness(1, 100);
-		lights[LIGHT + (switchPosition ^ 1)].setSmoothBrightness(0, 100);
+		lightState.store(switchPosition, std::memory_order_relaxed);
 	}
 };
 
@@ -78,6 +104,8 @@ struct Switch1Widget : ModuleWidget
 {
 	Switch1Widget(Switch1 *module)
 	{
+		GS_PROFILE_WIDGET("Switch1");
+
 		setModule(module);
 		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/Switch1.svg")));
 
@@ -99,6 +127,18 @@ struct Switch1Widget : ModuleWidget
 
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(col[1], row[4])), module, Switch1::OUTPUT));
 	}
+
+	void step() override
+	{
+		if (module)
+		{
+			int switchPosition = dynamic_cast<Switch1 *>(module)->lightState.load(std::memory_order_relaxed);
+			module->lights[Switch1::LIGHT + switchPosition].value = 1.f;
+			module->lights[Switch1::LIGHT + (switchPosition ^ 1)].value = 0.f;
+		}
+
+		ModuleWidget::step();
+	}
 };
 
 Model *modelSwitch1 = createModel<Switch1, Switch1Widget>("Switch1");
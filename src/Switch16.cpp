@@ -0,0 +1,284 @@
+#include "plugin.hpp"
+
+struct Switch16 : Module
+{
+	enum ParamIds
+	{
+		NUM_PARAMS
+	};
+	enum InputIds
+	{
+		ENUMS(INPUT, 16),
+		TRIGGER_INPUT,
+		INDEX_INPUT,
+		NUM_INPUTS
+	};
+	enum OutputIds
+	{
+		OUTPUT,
+		NUM_OUTPUTS
+	};
+	enum LightIds
+	{
+		ENUMS(LIGHT, 16),
+		NUM_LIGHTS
+	};
+
+	static const int NUM_FADES = 7;
+
+	dsp::TSchmittTrigger<simd::float_4> triggers[4];
+
+	int selection = 0;
+	/** Input the crossfade comes from */
+	int fadeFrom = 0;
+	/** Samples left of the running crossfade */
+	int fadeSamples = 0;
+	int fadeLength = 0;
+	int fadeIndex = 0;
+	/** Input the index CV pointed at last, it only selects when it moves to another input */
+	int lastIndex = -1;
+	float fadeMilliseconds[NUM_FADES] = {0.f, 1.f, 2.f, 5.f, 10.f, 20.f, 50.f};
+	/** selection for Switch16Widget::step() */
+	std::atomic<int> lightState{0};
+
+	struct Command
+	{
+		enum Type
+		{
+			SET_SELECTION,
+			SET_FADE
+		};
+		Type type;
+		int value;
+	};
+	CommandQueue<Command, 8> commands;
+
+	Switch16()
+	{
+		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		for (int i = 0; i < 16; i++)
+		{
+			configInput(INPUT + i, string::f("In %d", i + 1));
+		}
+		configInput(TRIGGER_INPUT, "Select (poly, channel N selects input N)");
+		configInput(INDEX_INPUT, "Index (0-10V spans input 1-16)");
+		configOutput(OUTPUT, "Out");
+	}
+
+	/** For menus, false if the engine has not caught up and the edit was dropped */
+	bool pushCommand(Command::Type type, int value)
+	{
+		if (!commands.push({type, value}))
+		{
+			WARN("Switch16: command queue full, edit dropped");
+			return false;
+		}
+		return true;
+	}
+
+	void applyCommand(const Command &command)
+	{
+		switch (command.type)
+		{
+		case Command::SET_SELECTION:
+			selection = clamp(command.value, 0, 15);
+			fadeSamples = 0;
+			break;
+		case Command::SET_FADE:
+			fadeIndex = clamp(command.value, 0, NUM_FADES - 1);
+			break;
+		}
+	}
+
+	void onReset() override
+	{
+		applyCommand({Command::SET_SELECTION, 0});
+		applyCommand({Command::SET_FADE, 0});
+	}
+
+	json_t *dataToJson() override
+	{
+		json_t *rootJ = json_object();
+		json_object_set_new(rootJ, "selection", json_integer(selection));
+		json_object_set_new(rootJ, "fadeIndex", json_integer(fadeIndex));
+		return rootJ;
+	}
+
+	void dataFromJson(json_t *rootJ) override
+	{
+		json_t *selectionJ = json_object_get(rootJ, "selection");
+		if (selectionJ)
+			applyCommand({Command::SET_SELECTION, (int)json_integer_value(selectionJ)});
+
+		json_t *fadeIndexJ = json_object_get(rootJ, "fadeIndex");
+		if (fadeIndexJ)
+			applyCommand({Command::SET_FADE, (int)json_integer_value(fadeIndexJ)});
+	}
+
+	void select(int input, float sampleRate)
+	{
+		if (input == selection)
+		{
+			return;
+		}
+
+		// The gain of fadeFrom, selection has the rest
+		float gain = fadeSamples > 0 ? (float)fadeSamples / fadeLength : 0.f;
+		fadeLength = (int)(fadeMilliseconds[fadeIndex] * 0.001f * sampleRate);
+		// A switch during a fade fades out the input that is louder in the mix, from the gain it has,
+		// so switching back to fadeFrom continues without a jump
+		if (input != fadeFrom && gain >= 0.5f)
+		{
+			fadeSamples = (int)(gain * fadeLength);
+		}
+		else
+		{
+			fadeFrom = selection;
+			fadeSamples = (int)((1.f - gain) * fadeLength);
+		}
+		selection = input;
+	}
+
+	/** Rising edges of the select channels, bit c is channel c */
+	int processTriggers()
+	{
+		int channels = inputs[TRIGGER_INPUT].getChannels();
+		int risingChannels = 0;
+		for (int c = 0; c < channels; c += 4)
+		{
+			simd::float_4 edges = triggers[c / 4].process(inputs[TRIGGER_INPUT].getVoltageSimd<simd::float_4>(c), 0.1f, 1.f);
+			risingChannels |= simd::movemask(edges) << c;
+		}
+		return risingChannels & ((1 << channels) - 1);
+	}
+
+	void process(const ProcessArgs &args) override
+	{
+		GS_PROFILE_PROCESS("Switch16");
+
+		Command command;
+		while (commands.pop(command))
+		{
+			applyCommand(command);
+		}
+
+		// Triggers win over the index, the lowest channel wins among triggers
+		int risingChannels = inputs[TRIGGER_INPUT].isConnected() ? processTriggers() : 0;
+		if (risingChannels)
+		{
+			int channel = 0;
+			while (!((risingChannels >> channel) & 1))
+			{
+				channel++;
+			}
+			select(channel, args.sampleRate);
+		}
+		else if (inputs[INDEX_INPUT].isConnected())
+		{
+			int index = clamp((int)(inputs[INDEX_INPUT].getVoltage() * 1.6f), 0, 15);
+			if (index != lastIndex)
+			{
+				lastIndex = index;
+				select(index, args.sampleRate);
+			}
+		}
+
+		Input &input = inputs[INPUT + selection];
+		Output &output = outputs[OUTPUT];
+		if (fadeSamples > 0)
+		{
+			Input &from = inputs[INPUT + fadeFrom];
+			int channels = std::max(from.getChannels(), input.getChannels());
+			float gain = (float)fadeSamples / fadeLength;
+			output.setChannels(channels);
+			for (int c = 0; c < channels; c += 4)
+			{
+				simd::float_4 fromVoltages = from.getPolyVoltageSimd<simd::float_4>(c);
+				simd::float_4 toVoltages = input.getPolyVoltageSimd<simd::float_4>(c);
+				output.setVoltageSimd(toVoltages + (fromVoltages - toVoltages) * gain, c);
+			}
+			fadeSamples--;
+		}
+		else
+		{
+			// One copy of the selected input, mono or poly
+			output.setChannels(input.getChannels());
+			output.writeVoltages(input.getVoltages());
+		}
+
+		lightState.store(selection, std::memory_order_relaxed);
+	}
+};
+
+struct Switch16Widget : ModuleWidget
+{
+	Switch16Widget(Switch16 *module)
+	{
+		GS_PROFILE_WIDGET("Switch16");
+
+		setModule(module);
+		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/Switch16.svg")));
+
+		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+		static const float col[5] = {8.f, 15.5f, 20.32f, 25.14f, 32.64f};
+		static const float row[9] = {18.f, 29.f, 40.f, 51.f, 62.f, 73.f, 84.f, 95.f, 111.f};
+		for (int i = 0; i < 8; i++)
+		{
+			addInput(createInputCentered<PJ301MPort>(mm2px(Vec(col[0], row[i])), module, Switch16::INPUT + i));
+			addChild(createLightCentered<SmallLight<GreenLight>>(mm2px(Vec(col[1], row[i])), module, Switch16::LIGHT + i));
+			addChild(createLightCentered<SmallLight<GreenLight>>(mm2px(Vec(col[3], row[i])), module, Switch16::LIGHT + 8 + i));
+			addInput(createInputCentered<PJ301MPort>(mm2px(Vec(col[4], row[i])), module, Switch16::INPUT + 8 + i));
+		}
+
+		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(col[0], row[8])), module, Switch16::TRIGGER_INPUT));
+		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(col[2], row[8])), module, Switch16::INDEX_INPUT));
+		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(col[4], row[8])), module, Switch16::OUTPUT));
+	}
+
+	void step() override
+	{
+		if (module)
+		{
+			int selection = dynamic_cast<Switch16 *>(module)->lightState.load(std::memory_order_relaxed);
+			for (int i = 0; i < 16; i++)
+			{
+				module->lights[Switch16::LIGHT + i].value = i == selection;
+			}
+		}
+
+		ModuleWidget::step();
+	}
+
+	void appendContextMenu(Menu *menu) override
+	{
+		Switch16 *module = dynamic_cast<Switch16 *>(this->module);
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Crossfade"));
+
+		struct FadeItem : MenuItem
+		{
+			Switch16 *module;
+			int fadeIndex;
+			void onAction(const event::Action &e) override
+			{
+				module->pushCommand(Switch16::Command::SET_FADE, fadeIndex);
+			}
+		};
+
+		for (int i = 0; i < Switch16::NUM_FADES; i++)
+		{
+			FadeItem *fadeItem = createMenuItem<FadeItem>(i == 0 ? std::string("Off") : string::f("%g ms", module->fadeMilliseconds[i]));
+			fadeItem->rightText = CHECKMARK(module->fadeIndex == i);
+			fadeItem->module = module;
+			fadeItem->fadeIndex = i;
+			menu->addChild(fadeItem);
+		}
+	}
+};
+
+Model *modelSwitch16 = createModel<Switch16, Switch16Widget>("Switch16");
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+
+// Walker's alias method: picks one of up to N outcomes with the given weights
+// from a single uniform draw in O(1). Building the table is O(N) (Vose's
+// variant), so callers rebuild it only when the weights really moved.
+
+template <int N>
+struct AliasTable
+{
+	/** Chance that a draw landing in a column keeps the column's own outcome instead of its alias */
+	float keep[N] = {};
+	int alias[N] = {};
+	int size = 0;
+
+	/** False if all weights are 0, sample() must not be called then */
+	bool build(const float *weights, int size)
+	{
+		float total = 0.f;
+		for (int i = 0; i < size; i++)
+		{
+			total += std::max(weights[i], 0.f);
+		}
+		this->size = total > 0.f ? size : 0;
+		if (this->size == 0)
+		{
+			return false;
+		}
+
+		// Columns below the average are topped up by the ones above it
+		float scaled[N];
+		int small[N];
+		int large[N];
+		int smallCount = 0;
+		int largeCount = 0;
+		for (int i = 0; i < size; i++)
+		{
+			scaled[i] = std::max(weights[i], 0.f) * size / total;
+			alias[i] = i;
+			if (scaled[i] < 1.f)
+				small[smallCount++] = i;
+			else
+				large[largeCount++] = i;
+		}
+
+		while (smallCount > 0 && largeCount > 0)
+		{
+			int lower = small[--smallCount];
+			int upper = large[--largeCount];
+			keep[lower] = scaled[lower];
+			alias[lower] = upper;
+			scaled[upper] -= 1.f - scaled[lower];
+			if (scaled[upper] < 1.f)
+				small[smallCount++] = upper;
+			else
+				large[largeCount++] = upper;
+		}
+
+		// What is left is full up to rounding errors
+		while (largeCount > 0)
+		{
+			keep[large[--largeCount]] = 1.f;
+		}
+		while (smallCount > 0)
+		{
+			keep[small[--smallCount]] = 1.f;
+		}
+		return true;
+	}
+
+	/** `uniform` is in [0, 1) */
+	int sample(float uniform) const
+	{
+		float position = uniform * size;
+		int column = std::min((int)position, size - 1);
+		return position - column < keep[column] ? column : alias[column];
+	}
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/** Single-producer/single-consumer ring for state edits from menus and widgets.
+The UI thread pushes, the engine drains it at the start of process().
+Neither side ever blocks.
+onReset(), onRandomize() and dataFromJson() apply their state directly instead:
+Rack holds the engine lock around them and serializes the module right after,
+and a bypassed module never drains the queue.
+*/
+template <typename TCommand, size_t S = 64>
+struct CommandQueue
+{
+	static_assert((S & (S - 1)) == 0, "CommandQueue size must be a power of two");
+
+	TCommand commands[S];
+	std::atomic<size_t> writeIndex{0};
+	std::atomic<size_t> readIndex{0};
+
+	/** UI thread only. Returns false if the engine has not caught up yet. */
+	bool push(const TCommand &command)
+	{
+		size_t write = writeIndex.load(std::memory_order_relaxed);
+		if (write - readIndex.load(std::memory_order_acquire) >= S)
+		{
+			return false;
+		}
+
+		commands[write & (S - 1)] = command;
+		writeIndex.store(write + 1, std::memory_order_release);
+		return true;
+	}
+
+	/** Engine thread only */
+	bool pop(TCommand &command)
+	{
+		size_t read = readIndex.load(std::memory_order_relaxed);
+		if (read == writeIndex.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+
+		command = commands[read & (S - 1)];
+		readIndex.store(read + 1, std::memory_order_release);
+		return true;
+	}
+};
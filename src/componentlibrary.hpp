@@ -6,13 +6,20 @@ using namespace rack;
 
 extern Plugin *pluginInstance;
 
+/** Loads a component's frames on first use, later instances share them instead of resolving the path and searching Rack's SVG cache again */
+#define GS_COMPONENT_FRAMES(name)                                                              \
+    static const std::shared_ptr<window::Svg> frames[2] = {                                    \
+        APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/" name "_0.svg")),  \
+        APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/" name "_1.svg"))}; \
+    addFrame(frames[0]);                                                                       \
+    addFrame(frames[1])
+
 struct ArrowLeft : rack::app::SvgSwitch
 {
     ArrowLeft()
     {
         momentary = true;
-        addFrame(APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/ArrowLeft_0.svg")));
-        addFrame(APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/ArrowLeft_1.svg")));
+        GS_COMPONENT_FRAMES("ArrowLeft");
     }
 };
 
@@ -21,8 +28,7 @@ struct ArrowRight : rack::app::SvgSwitch
     ArrowRight()
     {
         momentary = true;
-        addFrame(APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/ArrowRight_0.svg")));
-        addFrame(APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/ArrowRight_1.svg")));
+        GS_COMPONENT_FRAMES("ArrowRight");
     }
 };
 
@@ -31,8 +37,7 @@ struct ArrowUp : rack::app::SvgSwitch
     ArrowUp()
     {
         momentary = true;
-        addFrame(APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/ArrowUp_0.svg")));
-        addFrame(APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/ArrowUp_1.svg")));
+        GS_COMPONENT_FRAMES("ArrowUp");
     }
 };
 
@@ -41,8 +46,7 @@ struct ArrowDown : rack::app::SvgSwitch
     ArrowDown()
     {
         momentary = true;
-        addFrame(APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/ArrowDown_0.svg")));
-        addFrame(APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/ArrowDown_1.svg")));
+        GS_COMPONENT_FRAMES("ArrowDown");
     }
 };
 
@@ -50,7 +54,6 @@ struct SquareSwitch : rack::app::SvgSwitch
 {
     SquareSwitch()
     {
-        addFrame(APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/SquareSwitch_0.svg")));
-        addFrame(APP->window->loadSvg(asset::plugin(pluginInstance, "res/components/SquareSwitch_1.svg")));
+        GS_COMPONENT_FRAMES("SquareSwitch");
     }
 };
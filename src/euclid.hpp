@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+
+// Euclidean rhythms as step masks, bit i is step i. Everything up to 16 steps
+// is computed at compile time, so picking a pattern is a table lookup. Longer
+// rows (up to 64 steps) are computed when asked for.
+
+constexpr int EUCLID_TABLE_LENGTH = 16;
+
+constexpr uint16_t euclidStep(int pulses, int length, int step)
+{
+	return ((step * pulses) % length) < pulses ? (uint16_t)(1u << step) : (uint16_t)0u;
+}
+
+constexpr uint16_t euclidMask(int pulses, int length, int step = 0)
+{
+	return step >= length ? (uint16_t)0u : (uint16_t)(euclidStep(pulses, length, step) | euclidMask(pulses, length, step + 1));
+}
+
+#define EUCLID_ROW(length)                                                                                                       \
+	euclidMask(0, length), euclidMask(1, length), euclidMask(2, length), euclidMask(3, length), euclidMask(4, length),            \
+		euclidMask(5, length), euclidMask(6, length), euclidMask(7, length), euclidMask(8, length), euclidMask(9, length),       \
+		euclidMask(10, length), euclidMask(11, length), euclidMask(12, length), euclidMask(13, length), euclidMask(14, length), \
+		euclidMask(15, length), euclidMask(16, length)
+
+/** euclidTable[length * 17 + pulses], pulses beyond length saturate to all steps */
+static constexpr uint16_t euclidTable[(EUCLID_TABLE_LENGTH + 1) * (EUCLID_TABLE_LENGTH + 1)] = {
+	EUCLID_ROW(0), EUCLID_ROW(1), EUCLID_ROW(2), EUCLID_ROW(3), EUCLID_ROW(4), EUCLID_ROW(5),
+	EUCLID_ROW(6), EUCLID_ROW(7), EUCLID_ROW(8), EUCLID_ROW(9), EUCLID_ROW(10), EUCLID_ROW(11),
+	EUCLID_ROW(12), EUCLID_ROW(13), EUCLID_ROW(14), EUCLID_ROW(15), EUCLID_ROW(16)};
+
+#undef EUCLID_ROW
+
+static_assert(euclidTable[8 * 17 + 3] == 0x49, "E(3,8) must be the tresillo");
+static_assert(euclidTable[16 * 17 + 16] == 0xffff, "E(16,16) must fill all steps");
+
+/** The lowest `length` steps, for lengths up to 64 */
+inline uint64_t lowSteps(int length)
+{
+	return length >= 64 ? ~0ull : (1ull << length) - 1ull;
+}
+
+inline uint64_t getEuclidMask(int pulses, int length)
+{
+	if (length <= EUCLID_TABLE_LENGTH)
+	{
+		return euclidTable[length * (EUCLID_TABLE_LENGTH + 1) + pulses];
+	}
+
+	uint64_t mask = 0;
+	for (int step = 0; step < length; step++)
+	{
+		if ((step * pulses) % length < pulses)
+		{
+			mask |= 1ull << step;
+		}
+	}
+	return mask;
+}
+
+/** Rotates the lowest `length` steps of `mask` towards later steps */
+inline uint64_t rotateSteps(uint64_t mask, int length, int rotation)
+{
+	if (length <= 1)
+	{
+		return mask;
+	}
+
+	rotation %= length;
+	uint64_t field = mask & lowSteps(length);
+	if (rotation == 0)
+	{
+		return field;
+	}
+	return ((field << rotation) | (field >> (length - rotation))) & lowSteps(length);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+/** Stall's gate outputs and Flock's gate inputs are MIDI notes 35 to 82, gate i is note 35 + i */
+static const int STALL_NOTES = 48;
+
+/** 1V/oct of gate `note`, 0V is C4 (MIDI note 60) */
+inline float getStallNoteCv(int note)
+{
+	const float oneTwelfth = 1.0 / 12.0;
+	return (float)(note - 25) * oneTwelfth;
+}
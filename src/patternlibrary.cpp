@@ -0,0 +1,409 @@
+#include "plugin.hpp"
+#include "patternlibrary.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+
+#if defined ARCH_WIN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+PatternLibrary::~PatternLibrary()
+{
+	if (!bytes)
+	{
+		return;
+	}
+
+#if defined ARCH_WIN
+	UnmapViewOfFile(bytes);
+	CloseHandle((HANDLE)mapping);
+#else
+	munmap((void *)bytes, size);
+#endif
+}
+
+static bool isString(const uint8_t *bytes, size_t size, uint32_t offset)
+{
+	return offset < size && std::memchr(bytes + offset, 0, size - offset);
+}
+
+static bool isValidPattern(const uint8_t *bytes, const LibraryEntry &entry)
+{
+	if (entry.dataOffset % 8 != 0)
+	{
+		return false;
+	}
+
+	if (entry.kind == PATTERN_GRID)
+	{
+		if (entry.dataSize < sizeof(PatternGrid))
+		{
+			return false;
+		}
+		const PatternGrid *grid = (const PatternGrid *)(bytes + entry.dataOffset);
+		return grid->rows >= 1 && grid->rows <= 16 && grid->cols >= 1 && grid->cols <= 64 &&
+			   entry.dataSize >= sizeof(PatternGrid) + grid->rows * sizeof(uint64_t) + grid->rows * grid->cols;
+	}
+
+	if (entry.kind == PATTERN_ROWS)
+	{
+		if (entry.dataSize < sizeof(PatternRows))
+		{
+			return false;
+		}
+		const PatternRows *rows = (const PatternRows *)(bytes + entry.dataOffset);
+		return rows->steps >= 1 && rows->steps <= 64 && entry.dataSize >= sizeof(PatternRows) + 3 * rows->steps * sizeof(float);
+	}
+
+	return false;
+}
+
+PatternLibrary *PatternLibrary::open(const std::string &path)
+{
+	GS_TRACE_ZONE("PatternLibrary open");
+
+	std::unique_ptr<PatternLibrary> library(new PatternLibrary);
+
+#if defined ARCH_WIN
+	HANDLE file = CreateFileW(string::UTF8toUTF16(path).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return nullptr;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(LibraryHeader))
+	{
+		CloseHandle(file);
+		return nullptr;
+	}
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping)
+	{
+		return nullptr;
+	}
+	const void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view)
+	{
+		CloseHandle(mapping);
+		return nullptr;
+	}
+	library->mapping = mapping;
+	library->bytes = (const uint8_t *)view;
+	library->size = (size_t)fileSize.QuadPart;
+#else
+	int file = ::open(path.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		return nullptr;
+	}
+	struct stat fileStat;
+	if (fstat(file, &fileStat) != 0 || fileStat.st_size < (off_t)sizeof(LibraryHeader))
+	{
+		close(file);
+		return nullptr;
+	}
+	void *view = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (view == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	// Browsing from the engine thread should not wait for the disk
+	madvise(view, fileStat.st_size, MADV_WILLNEED);
+	library->bytes = (const uint8_t *)view;
+	library->size = (size_t)fileStat.st_size;
+#endif
+
+	const uint8_t *bytes = library->bytes;
+	size_t size = library->size;
+	const LibraryHeader *header = (const LibraryHeader *)bytes;
+	if (std::memcmp(header->magic, "GSPL", 4) != 0 || header->version != PATTERN_LIBRARY_VERSION || header->fileSize != size || header->tagCount > PATTERN_LIBRARY_MAX_TAGS)
+	{
+		return nullptr;
+	}
+	if (header->entriesOffset % 4 != 0 || header->entriesOffset + (uint64_t)header->patternCount * sizeof(LibraryEntry) > size)
+	{
+		return nullptr;
+	}
+	if (header->tagsOffset % 4 != 0 || header->tagsOffset + (uint64_t)header->tagCount * sizeof(uint32_t) > size)
+	{
+		return nullptr;
+	}
+
+	library->header = header;
+	library->entries = (const LibraryEntry *)(bytes + header->entriesOffset);
+	library->tags = (const uint32_t *)(bytes + header->tagsOffset);
+
+	for (uint32_t t = 0; t < header->tagCount; t++)
+	{
+		if (!isString(bytes, size, library->tags[t]))
+		{
+			return nullptr;
+		}
+	}
+
+	for (uint32_t i = 0; i < header->patternCount; i++)
+	{
+		const LibraryEntry &entry = library->entries[i];
+		if (!isString(bytes, size, entry.nameOffset) || (uint64_t)entry.dataOffset + entry.dataSize > size || !isValidPattern(bytes, entry))
+		{
+			return nullptr;
+		}
+		// findByName() relies on the order
+		if (i > 0 && std::strcmp(library->getName(i - 1), library->getName(i)) > 0)
+		{
+			return nullptr;
+		}
+
+		library->index[entry.kind][PATTERN_LIBRARY_MAX_TAGS].push_back(i);
+		for (uint32_t t = 0; t < header->tagCount; t++)
+		{
+			if ((entry.tagMask >> t) & 1)
+			{
+				library->index[entry.kind][t].push_back(i);
+			}
+		}
+	}
+
+	return library.release();
+}
+
+static void appendBytes(std::vector<uint8_t> &buffer, const void *data, size_t size)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+static void alignBuffer(std::vector<uint8_t> &buffer)
+{
+	buffer.resize((buffer.size() + 7) & ~(size_t)7, 0);
+}
+
+bool PatternLibrary::write(const std::string &path, const std::vector<PatternRecord> &records)
+{
+	std::vector<const PatternRecord *> sorted;
+	for (const PatternRecord &record : records)
+	{
+		sorted.push_back(&record);
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), [](const PatternRecord *a, const PatternRecord *b) {
+		return std::strcmp(a->name.c_str(), b->name.c_str()) < 0;
+	});
+
+	// Tags in order of first use, the ones beyond the limit are dropped
+	std::vector<std::string> tagNames;
+	std::vector<uint32_t> tagMasks;
+	for (const PatternRecord *record : sorted)
+	{
+		uint32_t tagMask = 0;
+		for (const std::string &tag : record->tags)
+		{
+			int t = std::find(tagNames.begin(), tagNames.end(), tag) - tagNames.begin();
+			if (t == (int)tagNames.size() && t < PATTERN_LIBRARY_MAX_TAGS)
+			{
+				tagNames.push_back(tag);
+			}
+			if (t < PATTERN_LIBRARY_MAX_TAGS)
+			{
+				tagMask |= 1u << t;
+			}
+		}
+		tagMasks.push_back(tagMask);
+	}
+
+	LibraryHeader header = {};
+	std::memcpy(header.magic, "GSPL", 4);
+	header.version = PATTERN_LIBRARY_VERSION;
+	header.patternCount = sorted.size();
+	header.tagCount = tagNames.size();
+	header.entriesOffset = sizeof(LibraryHeader);
+	header.tagsOffset = header.entriesOffset + header.patternCount * sizeof(LibraryEntry);
+
+	std::vector<LibraryEntry> entries(sorted.size());
+	std::vector<uint32_t> tagOffsets(tagNames.size());
+	std::vector<uint8_t> buffer(header.tagsOffset + header.tagCount * sizeof(uint32_t), 0);
+
+	for (size_t t = 0; t < tagNames.size(); t++)
+	{
+		tagOffsets[t] = buffer.size();
+		appendBytes(buffer, tagNames[t].c_str(), tagNames[t].size() + 1);
+	}
+	for (size_t i = 0; i < sorted.size(); i++)
+	{
+		entries[i].nameOffset = buffer.size();
+		appendBytes(buffer, sorted[i]->name.c_str(), sorted[i]->name.size() + 1);
+	}
+	for (size_t i = 0; i < sorted.size(); i++)
+	{
+		alignBuffer(buffer);
+		entries[i].tagMask = tagMasks[i];
+		entries[i].kind = sorted[i]->kind;
+		entries[i].dataOffset = buffer.size();
+		entries[i].dataSize = sorted[i]->data.size();
+		appendBytes(buffer, sorted[i]->data.data(), sorted[i]->data.size());
+	}
+	alignBuffer(buffer);
+
+	header.fileSize = buffer.size();
+	std::memcpy(buffer.data(), &header, sizeof(header));
+	if (!entries.empty())
+	{
+		std::memcpy(buffer.data() + header.entriesOffset, entries.data(), entries.size() * sizeof(LibraryEntry));
+	}
+	if (!tagOffsets.empty())
+	{
+		std::memcpy(buffer.data() + header.tagsOffset, tagOffsets.data(), tagOffsets.size() * sizeof(uint32_t));
+	}
+
+	// Readers keep their mapping of the old file
+	std::string tempPath = path + ".tmp";
+	FILE *file = std::fopen(tempPath.c_str(), "wb");
+	if (!file)
+	{
+		return false;
+	}
+	bool isWritten = std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+	isWritten = std::fclose(file) == 0 && isWritten;
+	if (!isWritten)
+	{
+		std::remove(tempPath.c_str());
+		return false;
+	}
+
+#if defined ARCH_WIN
+	return MoveFileExW(string::UTF8toUTF16(tempPath).c_str(), string::UTF8toUTF16(path).c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+	return std::rename(tempPath.c_str(), path.c_str()) == 0;
+#endif
+}
+
+int PatternLibrary::findByName(const char *name) const
+{
+	int low = 0;
+	int high = getCount() - 1;
+	while (low <= high)
+	{
+		int middle = (low + high) / 2;
+		int order = std::strcmp(getName(middle), name);
+		if (order == 0)
+		{
+			return middle;
+		}
+		if (order < 0)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle - 1;
+		}
+	}
+	return -1;
+}
+
+int PatternLibrary::findTag(const std::string &name) const
+{
+	for (int t = 0; t < getTagCount(); t++)
+	{
+		if (name == getTagName(t))
+		{
+			return t;
+		}
+	}
+	return -1;
+}
+
+PatternRecord PatternLibrary::getRecord(int i) const
+{
+	PatternRecord record;
+	record.name = getName(i);
+	for (int t = 0; t < getTagCount(); t++)
+	{
+		if ((entries[i].tagMask >> t) & 1)
+		{
+			record.tags.push_back(getTagName(t));
+		}
+	}
+	record.kind = entries[i].kind;
+	record.data.assign(getData(i), getData(i) + entries[i].dataSize);
+	return record;
+}
+
+static std::mutex userLibraryMutex;
+static std::atomic<PatternLibrary *> userLibrary{nullptr};
+/** Replaced libraries stay mapped until the plugin is unloaded, the engine may still be reading them */
+static std::vector<std::unique_ptr<PatternLibrary>> userLibraries;
+static bool isUserLibraryLoaded = false;
+
+static std::string getUserLibraryPath()
+{
+	return asset::user("GoodSheperd/patterns.gspl");
+}
+
+static PatternLibrary *loadUserLibrary()
+{
+	// A missing or broken file is tried again next time, the user may add it while Rack runs
+	if (!isUserLibraryLoaded)
+	{
+		PatternLibrary *library = PatternLibrary::open(getUserLibraryPath());
+		if (library)
+		{
+			isUserLibraryLoaded = true;
+			userLibraries.emplace_back(library);
+			userLibrary.store(library);
+		}
+	}
+	return userLibrary.load();
+}
+
+PatternLibrary *PatternLibrary::load()
+{
+	std::lock_guard<std::mutex> lock(userLibraryMutex);
+	return loadUserLibrary();
+}
+
+PatternLibrary *PatternLibrary::current()
+{
+	return userLibrary.load(std::memory_order_acquire);
+}
+
+bool PatternLibrary::save(const PatternRecord &record)
+{
+	std::lock_guard<std::mutex> lock(userLibraryMutex);
+
+	std::vector<PatternRecord> records;
+	PatternLibrary *library = loadUserLibrary();
+	for (int i = 0; library && i < library->getCount(); i++)
+	{
+		if (record.name != library->getName(i))
+		{
+			records.push_back(library->getRecord(i));
+		}
+	}
+	records.push_back(record);
+
+	system::createDirectories(asset::user("GoodSheperd"));
+	if (!write(getUserLibraryPath(), records))
+	{
+		return false;
+	}
+
+	PatternLibrary *written = open(getUserLibraryPath());
+	if (!written)
+	{
+		return false;
+	}
+	userLibraries.emplace_back(written);
+	userLibrary.store(written, std::memory_order_release);
+	return true;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary pattern library shared by the sequencers. The file is memory-mapped
+// read-only, so browsing it never parses or allocates. Layout, little-endian:
+//
+//   LibraryHeader
+//   LibraryEntry[patternCount]   sorted by name
+//   uint32_t[tagCount]           offsets of the tag names
+//   NUL-terminated strings, then the pattern data, 8-byte aligned
+//
+// tools/pattern_library.py writes the same format from patches.
+
+static const uint32_t PATTERN_LIBRARY_VERSION = 1;
+/** Tags are a bit mask per entry */
+static const int PATTERN_LIBRARY_MAX_TAGS = 32;
+
+enum PatternKind
+{
+	/** Gate grid of the Stable16 family: PatternGrid, then rows step words, then rows * cols probabilities */
+	PATTERN_GRID = 1,
+	/** SEQ3st: PatternRows, then 3 * steps voltages */
+	PATTERN_ROWS = 2,
+	NUM_PATTERN_KINDS
+};
+
+struct LibraryHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t patternCount;
+	uint32_t tagCount;
+	uint32_t entriesOffset;
+	uint32_t tagsOffset;
+	uint32_t fileSize;
+	uint32_t reserved;
+};
+
+struct LibraryEntry
+{
+	uint32_t nameOffset;
+	uint32_t tagMask;
+	uint32_t kind;
+	uint32_t dataOffset;
+	uint32_t dataSize;
+	uint32_t reserved;
+};
+
+struct PatternGrid
+{
+	uint32_t rows;
+	uint32_t cols;
+	// uint64_t steps[rows], bit x is step x
+	// uint8_t probabilities[rows * cols], padded to 8 bytes
+};
+
+struct PatternRows
+{
+	uint32_t steps;
+	uint32_t reserved;
+	/** Bit i is the gate of step i */
+	uint64_t gates;
+	// float values[3 * steps], row by row
+};
+
+/** A pattern on its way into a library file */
+struct PatternRecord
+{
+	std::string name;
+	std::vector<std::string> tags;
+	uint32_t kind = PATTERN_GRID;
+	std::vector<uint8_t> data;
+};
+
+struct PatternLibrary
+{
+	const uint8_t *bytes = nullptr;
+	size_t size = 0;
+	const LibraryHeader *header = nullptr;
+	const LibraryEntry *entries = nullptr;
+	const uint32_t *tags = nullptr;
+	/** Entry indices by kind and tag filter, the last filter is "all tags" */
+	std::vector<uint32_t> index[NUM_PATTERN_KINDS][PATTERN_LIBRARY_MAX_TAGS + 1];
+	void *mapping = nullptr;
+
+	~PatternLibrary();
+
+	/** Maps and validates `path`, nullptr if it is missing or broken */
+	static PatternLibrary *open(const std::string &path);
+	/** Writes a new library file through a temporary file and rename */
+	static bool write(const std::string &path, const std::vector<PatternRecord> &records);
+
+	/** The user library, opened on first use. UI thread only. */
+	static PatternLibrary *load();
+	/** The user library if it has been opened. Safe on the engine thread. */
+	static PatternLibrary *current();
+	/** Adds or replaces a pattern in the user library and publishes the new file. UI thread only. */
+	static bool save(const PatternRecord &record);
+
+	int getCount() const
+	{
+		return header ? (int)header->patternCount : 0;
+	}
+
+	int getTagCount() const
+	{
+		return header ? (int)header->tagCount : 0;
+	}
+
+	const char *getName(int i) const
+	{
+		return (const char *)bytes + entries[i].nameOffset;
+	}
+
+	const char *getTagName(int tag) const
+	{
+		return (const char *)bytes + tags[tag];
+	}
+
+	const uint8_t *getData(int i) const
+	{
+		return bytes + entries[i].dataOffset;
+	}
+
+	/** Entries of `kind` carrying `tag`, or all of them for tag -1 */
+	const std::vector<uint32_t> &getIndex(int kind, int tag) const
+	{
+		return index[kind][tag < 0 || tag >= PATTERN_LIBRARY_MAX_TAGS ? PATTERN_LIBRARY_MAX_TAGS : tag];
+	}
+
+	/** Binary search, -1 if there is no such pattern */
+	int findByName(const char *name) const;
+	int findTag(const std::string &name) const;
+	PatternRecord getRecord(int i) const;
+};
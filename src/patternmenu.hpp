@@ -0,0 +1,148 @@
+#pragma once
+
+#include "plugin.hpp"
+#include "patternlibrary.hpp"
+
+#include <functional>
+#include <sstream>
+
+/** Type a name and press enter to save the module's pattern, words starting with # are tags */
+struct PatternNameField : ui::TextField
+{
+	std::function<PatternRecord()> makeRecord;
+
+	PatternNameField()
+	{
+		box.size.x = 200.f;
+		placeholder = "Name #tag #tag";
+	}
+
+	void onSelectKey(const event::SelectKey &e) override
+	{
+		if (e.action == GLFW_PRESS && (e.key == GLFW_KEY_ENTER || e.key == GLFW_KEY_KP_ENTER))
+		{
+			PatternRecord record = makeRecord();
+			std::istringstream words(text);
+			std::string word;
+			while (words >> word)
+			{
+				if (word[0] == '#' && word.size() > 1)
+				{
+					record.tags.push_back(word.substr(1));
+				}
+				else
+				{
+					record.name += (record.name.empty() ? "" : " ") + word;
+				}
+			}
+
+			if (!record.name.empty())
+			{
+				PatternLibrary::save(record);
+			}
+
+			ui::MenuOverlay *overlay = getAncestorOfType<ui::MenuOverlay>();
+			if (overlay)
+			{
+				overlay->requestDelete();
+			}
+			e.consume(this);
+			return;
+		}
+
+		TextField::onSelectKey(e);
+	}
+};
+
+struct PatternLoadItem : MenuItem
+{
+	std::function<void(const PatternLibrary *, int)> loadPattern;
+	/** The library the menu listed, a save in between may have replaced the current one */
+	const PatternLibrary *library;
+	int entry;
+	void onAction(const event::Action &e) override
+	{
+		loadPattern(library, entry);
+	}
+};
+
+struct PatternTagItem : MenuItem
+{
+	std::function<void(int)> setTag;
+	int tag;
+	void onAction(const event::Action &e) override
+	{
+		setTag(tag);
+	}
+};
+
+struct PatternTagMenuItem : MenuItem
+{
+	std::function<void(int)> setTag;
+	int tag;
+	Menu *createChildMenu() override
+	{
+		Menu *menu = new Menu;
+		PatternLibrary *library = PatternLibrary::load();
+		for (int t = -1; library && t < library->getTagCount(); t++)
+		{
+			PatternTagItem *tagItem = createMenuItem<PatternTagItem>(t < 0 ? "All" : library->getTagName(t));
+			tagItem->rightText = CHECKMARK(tag == t);
+			tagItem->setTag = setTag;
+			tagItem->tag = t;
+			menu->addChild(tagItem);
+		}
+		return menu;
+	}
+};
+
+/** Pattern library submenu: tag filter, the patterns of one kind and a field to save the current one */
+struct PatternLibraryMenuItem : MenuItem
+{
+	int kind;
+	/** Tag filter, -1 for all */
+	int tag = -1;
+	/** Entry that was loaded last, gets a checkmark */
+	int loaded = -1;
+	std::function<void(const PatternLibrary *, int)> loadPattern;
+	std::function<void(int)> setTag;
+	std::function<PatternRecord()> makeRecord;
+
+	Menu *createChildMenu() override
+	{
+		Menu *menu = new Menu;
+		PatternLibrary *library = PatternLibrary::load();
+
+		if (library && library->getTagCount() > 0)
+		{
+			PatternTagMenuItem *tagMenuItem = createMenuItem<PatternTagMenuItem>("Tag", RIGHT_ARROW);
+			tagMenuItem->setTag = setTag;
+			tagMenuItem->tag = tag;
+			menu->addChild(tagMenuItem);
+		}
+
+		const std::vector<uint32_t> *patterns = library ? &library->getIndex(kind, tag) : nullptr;
+		if (!patterns || patterns->empty())
+		{
+			menu->addChild(createMenuLabel("No patterns yet"));
+		}
+		for (size_t i = 0; patterns && i < patterns->size(); i++)
+		{
+			int entry = (*patterns)[i];
+			PatternLoadItem *loadItem = createMenuItem<PatternLoadItem>(library->getName(entry));
+			loadItem->rightText = CHECKMARK(loaded == entry);
+			loadItem->loadPattern = loadPattern;
+			loadItem->library = library;
+			loadItem->entry = entry;
+			menu->addChild(loadItem);
+		}
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Save as"));
+		PatternNameField *nameField = new PatternNameField;
+		nameField->makeRecord = makeRecord;
+		menu->addChild(nameField);
+
+		return menu;
+	}
+};
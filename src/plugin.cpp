@@ -6,10 +6,16 @@ void init(Plugin *p)
 {
 	pluginInstance = p;
 
+	p->addModel(modelFlock);
 	p->addModel(modelHurdle);
+	p->addModel(modelHurdle8);
 	p->addModel(modelSEQ3st);
 	p->addModel(modelStable16);
+	p->addModel(modelStable4x16);
+	p->addModel(modelStable8x32);
+	p->addModel(modelStable16x64);
 	p->addModel(modelStall);
 	p->addModel(modelSwitch1);
+	p->addModel(modelSwitch16);
 	p->addModel(modelSeqtrol);
 }
@@ -1,6 +1,10 @@
 #pragma once
 #include "rack.hpp"
 #include "componentlibrary.hpp"
+#include "commandqueue.hpp"
+#include "profile.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
 
 using namespace rack;
 
@@ -8,9 +12,15 @@ using namespace rack;
 extern Plugin *pluginInstance;
 
 // Forward-declare each Model, defined in each module source file
+extern Model *modelFlock;
 extern Model *modelHurdle;
+extern Model *modelHurdle8;
 extern Model *modelSEQ3st;
 extern Model *modelStable16;
+extern Model *modelStable4x16;
+extern Model *modelStable8x32;
+extern Model *modelStable16x64;
 extern Model *modelStall;
 extern Model *modelSwitch1;
+extern Model *modelSwitch16;
 extern Model *modelSeqtrol;
@@ -0,0 +1,125 @@
+#pragma once
+
+// Per-model process() timing for the headless benchmark (tools/bench_headless.py)
+// and widget construction timing for tools/bench_widgets.py.
+// Build with `make PROFILE=1`. Without it the GS_PROFILE_* macros compile to nothing.
+
+#ifdef GOODSHEPERD_PROFILE
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+#include "rack.hpp"
+
+struct ProfileSlot
+{
+	const char *name = nullptr;
+	std::atomic<uint64_t> calls{0};
+	std::atomic<uint64_t> nanoseconds{0};
+};
+
+/** Writes all slots to $GOODSHEPERD_PROFILE_CSV when the plugin is unloaded */
+struct ProfileRegistry
+{
+	std::mutex mutex;
+	ProfileSlot slots[32];
+	int slotCount = 0;
+
+	static ProfileRegistry &get()
+	{
+		static ProfileRegistry registry;
+		return registry;
+	}
+
+	ProfileSlot &add(const char *name)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ProfileSlot &slot = slots[std::min(slotCount++, 31)];
+		slot.name = name;
+		return slot;
+	}
+
+	~ProfileRegistry()
+	{
+		const char *path = std::getenv("GOODSHEPERD_PROFILE_CSV");
+		FILE *file = path ? std::fopen(path, "a") : nullptr;
+		if (!file)
+		{
+			return;
+		}
+
+		for (int i = 0; i < std::min(slotCount, 32); i++)
+		{
+			std::fprintf(file, "%s,%llu,%llu\n", slots[i].name, (unsigned long long)slots[i].calls.load(), (unsigned long long)slots[i].nanoseconds.load());
+		}
+		std::fclose(file);
+	}
+};
+
+struct ProfileTimer
+{
+	ProfileSlot &slot;
+	std::chrono::steady_clock::time_point start;
+
+	explicit ProfileTimer(ProfileSlot &slot) : slot(slot), start(std::chrono::steady_clock::now()) {}
+
+	~ProfileTimer()
+	{
+		uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		slot.calls.fetch_add(1, std::memory_order_relaxed);
+		slot.nanoseconds.fetch_add(elapsed, std::memory_order_relaxed);
+	}
+};
+
+#define GS_PROFILE_PROCESS(name)                                              \
+	static ProfileSlot &gsProfileSlot = ProfileRegistry::get().add(name); \
+	ProfileTimer gsProfileTimer(gsProfileSlot)
+
+/** Appends "name,preview,nanoseconds,widgets" to $GOODSHEPERD_WIDGET_CSV when the constructor returns */
+struct WidgetTimer
+{
+	const char *name;
+	const rack::widget::Widget *widget;
+	bool isPreview;
+	std::chrono::steady_clock::time_point start;
+
+	WidgetTimer(const char *name, const rack::widget::Widget *widget, bool isPreview) : name(name), widget(widget), isPreview(isPreview), start(std::chrono::steady_clock::now()) {}
+
+	static int countWidgets(const rack::widget::Widget *widget)
+	{
+		int count = 1;
+		for (const rack::widget::Widget *child : widget->children)
+		{
+			count += countWidgets(child);
+		}
+		return count;
+	}
+
+	~WidgetTimer()
+	{
+		uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		const char *path = std::getenv("GOODSHEPERD_WIDGET_CSV");
+		FILE *file = path ? std::fopen(path, "a") : nullptr;
+		if (!file)
+		{
+			return;
+		}
+		std::fprintf(file, "%s,%d,%llu,%d\n", name, (int)isPreview, (unsigned long long)elapsed, countWidgets(widget));
+		std::fclose(file);
+	}
+};
+
+/** First statement of a ModuleWidget constructor. The module browser builds previews without a module. */
+#define GS_PROFILE_WIDGET(name) WidgetTimer gsWidgetTimer(name, this, module == nullptr)
+
+#else
+
+#define GS_PROFILE_PROCESS(name) ((void)0)
+#define GS_PROFILE_WIDGET(name) ((void)0)
+
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+
+/** Triple buffer for state the engine publishes and the UI thread reads,
+e.g. to derive lights in ModuleWidget::step().
+Neither side ever blocks and the reader always sees a complete state.
+*/
+template <typename TState>
+struct Snapshot
+{
+	static const int FRESH = 4;
+
+	TState states[3] = {};
+	/** Index of the latest published state, FRESH until the reader has taken it */
+	std::atomic<int> latest{0};
+	int writing = 1;
+	int reading = 2;
+
+	/** Engine thread only */
+	void publish(const TState &state)
+	{
+		states[writing] = state;
+		writing = latest.exchange(writing | FRESH, std::memory_order_acq_rel) & 3;
+	}
+
+	/** UI thread only. Returns the latest published state. */
+	const TState &read()
+	{
+		if (latest.load(std::memory_order_relaxed) & FRESH)
+		{
+			reading = latest.exchange(reading, std::memory_order_acq_rel) & 3;
+		}
+		return states[reading];
+	}
+};
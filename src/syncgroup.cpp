@@ -0,0 +1,167 @@
+#include "syncgroup.hpp"
+
+#include <cstring>
+
+static SyncGroup syncGroups[NUM_SYNC_GROUPS];
+
+SyncGroup &SyncGroup::get(int group)
+{
+	return syncGroups[clamp(group, 0, NUM_SYNC_GROUPS - 1)];
+}
+
+std::string SyncGroup::getName(int group)
+{
+	return std::string(1, (char)('A' + group));
+}
+
+static uint32_t floatBits(float value)
+{
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+static float bitsFloat(uint32_t bits)
+{
+	float value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+void SyncLink::join(int group, bool lead, int64_t moduleId)
+{
+	leave(moduleId);
+	if (group < 0 || group >= NUM_SYNC_GROUPS)
+	{
+		return;
+	}
+
+	this->group = group;
+	followedLeader = -1;
+	if (lead)
+	{
+		// Takes over from the current leader, which follows from now on
+		SyncGroup::get(group).leader.store(moduleId);
+	}
+}
+
+void SyncLink::restore(int group, bool lead, int64_t moduleId)
+{
+	join(group, false, moduleId);
+	if (lead && this->group >= 0)
+	{
+		int64_t leader = -1;
+		SyncGroup::get(group).leader.compare_exchange_strong(leader, moduleId);
+	}
+}
+
+void SyncLink::leave(int64_t moduleId)
+{
+	int group = this->group.exchange(-1);
+	if (group >= 0)
+	{
+		int64_t leader = moduleId;
+		SyncGroup::get(group).leader.compare_exchange_strong(leader, -1);
+	}
+}
+
+bool SyncLink::isLeader(int64_t moduleId) const
+{
+	int group = this->group.load(std::memory_order_relaxed);
+	return group >= 0 && SyncGroup::get(group).leader.load(std::memory_order_relaxed) == moduleId;
+}
+
+void SyncLink::publish(int64_t moduleId, int64_t frame, float phase, float phasePerFrame, bool gate)
+{
+	if (!isLeader(moduleId))
+	{
+		return;
+	}
+
+	SyncGroup &syncGroup = SyncGroup::get(group.load(std::memory_order_relaxed));
+	uint32_t sequence = syncGroup.sequence.load(std::memory_order_relaxed);
+	syncGroup.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	syncGroup.frame.store(frame, std::memory_order_relaxed);
+	syncGroup.counters.store(steps | (uint64_t)resets << 32, std::memory_order_relaxed);
+	syncGroup.phases.store(floatBits(phase) | (uint64_t)floatBits(phasePerFrame) << 32, std::memory_order_relaxed);
+	syncGroup.gate.store(gate, std::memory_order_relaxed);
+	syncGroup.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool SyncLink::follow(int64_t moduleId, int64_t frame, SyncClock &clock)
+{
+	int group = this->group.load(std::memory_order_relaxed);
+	if (group < 0)
+	{
+		return false;
+	}
+
+	SyncGroup &syncGroup = SyncGroup::get(group);
+	int64_t leader = syncGroup.leader.load(std::memory_order_relaxed);
+	if (leader < 0 || leader == moduleId)
+	{
+		followedLeader = -1;
+		return false;
+	}
+
+	int64_t leaderFrame;
+	uint64_t counters;
+	uint64_t phases;
+	bool gate;
+	uint32_t sequence;
+	do
+	{
+		sequence = syncGroup.sequence.load(std::memory_order_acquire);
+		leaderFrame = syncGroup.frame.load(std::memory_order_relaxed);
+		counters = syncGroup.counters.load(std::memory_order_relaxed);
+		phases = syncGroup.phases.load(std::memory_order_relaxed);
+		gate = syncGroup.gate.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while ((sequence & 1) || sequence != syncGroup.sequence.load(std::memory_order_relaxed));
+
+	// The leader wrote in this frame or the one before, older means it is bypassed or stopped processing
+	int64_t frames = frame - leaderFrame;
+	if (frames < 0 || frames > 1)
+	{
+		followedLeader = -1;
+		return false;
+	}
+
+	uint32_t steps = (uint32_t)counters;
+	uint32_t resets = (uint32_t)(counters >> 32);
+	float phase = bitsFloat((uint32_t)phases);
+	float phasePerFrame = bitsFloat((uint32_t)(phases >> 32));
+	if (frames == 1 && phasePerFrame > 0.f)
+	{
+		// The leader hasn't run yet in this frame, its internal clock does the same sum
+		phase += phasePerFrame;
+		if (phase >= 1.f)
+		{
+			steps++;
+			phase = 0.f;
+		}
+		gate = phase < 0.5f;
+	}
+
+	if (leader != followedLeader)
+	{
+		// A new leader or the first frame: lock on without stepping
+		followedLeader = leader;
+		leaderSteps = steps;
+		leaderResets = resets;
+	}
+
+	// A step predicted a frame early is not taken again, one the leader's tempo CV delayed is not taken back
+	clock.step = (int32_t)(steps - leaderSteps) > 0;
+	if (clock.step)
+	{
+		leaderSteps = steps;
+	}
+	clock.reset = resets != leaderResets;
+	leaderResets = resets;
+	clock.gate = gate;
+	clock.phase = phase;
+	clock.period = phasePerFrame > 0.f ? (uint32_t)(1.f / phasePerFrame) : 0;
+	return true;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "plugin.hpp"
+
+#include <functional>
+
+// Process-wide clock groups, so sequencers stay in step without cables. One
+// leader per group publishes its step count, reset count and clock phase
+// every frame. Any number of followers read it lock-free through a sequence
+// lock and extrapolate the leader's internal clock to their own frame, so
+// the order in which the engine threads process them doesn't matter.
+
+static const int NUM_SYNC_GROUPS = 4;
+
+/** The leader's clock as a follower sees it in one frame */
+struct SyncClock
+{
+	bool step = false;
+	bool reset = false;
+	bool gate = false;
+	float phase = 0.f;
+	/** Samples per step, for scheduling */
+	uint32_t period = 0;
+};
+
+struct SyncGroup
+{
+	/** Module id of the leader, -1 if the group has none */
+	std::atomic<int64_t> leader{-1};
+	/** Odd while the leader writes */
+	std::atomic<uint32_t> sequence{0};
+	std::atomic<int64_t> frame{-1};
+	/** Steps in the low word, resets in the high word */
+	std::atomic<uint64_t> counters{0};
+	/** Bits of the phase in the low word, of the phase increment per frame in the high word */
+	std::atomic<uint64_t> phases{0};
+	std::atomic<bool> gate{false};
+
+	static SyncGroup &get(int group);
+	static std::string getName(int group);
+};
+
+/** A module's membership, all calls from the engine thread or under the engine lock */
+struct SyncLink
+{
+	/** -1 while the module runs its own clock. Atomic because the UI thread reads it for the menu and dataToJson() */
+	std::atomic<int> group{-1};
+	/** Steps and resets of this module, published while it leads */
+	uint32_t steps = 0;
+	uint32_t resets = 0;
+	/** Leader and counters seen last while following */
+	int64_t followedLeader = -1;
+	uint32_t leaderSteps = 0;
+	uint32_t leaderResets = 0;
+
+	void join(int group, bool lead, int64_t moduleId);
+	/** join() for dataFromJson(), a saved leader only leads if the group has none, so clones and presets follow the original */
+	void restore(int group, bool lead, int64_t moduleId);
+	void leave(int64_t moduleId);
+	bool isLeader(int64_t moduleId) const;
+	/** Leader: after the clock and reset of the frame. phasePerFrame is 0 for external clocks */
+	void publish(int64_t moduleId, int64_t frame, float phase, float phasePerFrame, bool gate);
+	/** Follower: the leader's clock in this frame, false if the group has no running leader */
+	bool follow(int64_t moduleId, int64_t frame, SyncClock &clock);
+};
+
+/** "Sync group" submenu, Off or lead or follow one of the groups */
+struct SyncGroupMenuItem : MenuItem
+{
+	std::function<void(int, bool)> setGroup;
+	int group;
+	bool isLeader;
+
+	struct GroupItem : MenuItem
+	{
+		std::function<void(int, bool)> setGroup;
+		int group;
+		bool lead;
+		void onAction(const event::Action &e) override
+		{
+			setGroup(group, lead);
+		}
+	};
+
+	Menu *createChildMenu() override
+	{
+		Menu *menu = new Menu;
+		GroupItem *offItem = createMenuItem<GroupItem>("Off", CHECKMARK(group < 0));
+		offItem->setGroup = setGroup;
+		offItem->group = -1;
+		offItem->lead = false;
+		menu->addChild(offItem);
+
+		for (int lead = 1; lead >= 0; lead--)
+		{
+			for (int i = 0; i < NUM_SYNC_GROUPS; i++)
+			{
+				std::string text = (lead ? "Lead " : "Follow ") + SyncGroup::getName(i);
+				GroupItem *groupItem = createMenuItem<GroupItem>(text, CHECKMARK(group == i && isLeader == (bool)lead));
+				groupItem->setGroup = setGroup;
+				groupItem->group = i;
+				groupItem->lead = lead;
+				menu->addChild(groupItem);
+			}
+		}
+		return menu;
+	}
+};
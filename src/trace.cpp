@@ -0,0 +1,82 @@
+#include "trace.hpp"
+
+#ifdef GOODSHEPERD_TRACE
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+namespace tracing
+{
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+uint64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+struct Registry
+{
+	std::mutex mutex;
+	std::vector<ThreadBuffer *> buffers;
+
+	ThreadBuffer *add()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ThreadBuffer *buffer = new ThreadBuffer;
+		buffer->threadId = (int)buffers.size() + 1;
+		buffers.push_back(buffer);
+		return buffer;
+	}
+
+	~Registry()
+	{
+		const char *path = std::getenv("GOODSHEPERD_TRACE_JSON");
+		FILE *file = std::fopen(path ? path : "GoodSheperd-trace.json", "w");
+		if (file)
+		{
+			std::fprintf(file, "{\"traceEvents\":[\n");
+			bool first = true;
+			for (ThreadBuffer *buffer : buffers)
+			{
+				uint32_t count = buffer->count.load(std::memory_order_acquire);
+				uint32_t begin = count > ThreadBuffer::SIZE ? count - ThreadBuffer::SIZE : 0;
+				for (uint32_t i = begin; i < count; i++)
+				{
+					const Event &event = buffer->events[i & (ThreadBuffer::SIZE - 1)];
+					if (event.duration)
+					{
+						std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n", event.name, buffer->threadId, event.start * 1e-3, event.duration * 1e-3);
+					}
+					else
+					{
+						std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", first ? "" : ",\n", event.name, buffer->threadId, event.start * 1e-3);
+					}
+					first = false;
+				}
+			}
+			std::fprintf(file, "\n]}\n");
+			std::fclose(file);
+		}
+
+		for (ThreadBuffer *buffer : buffers)
+		{
+			delete buffer;
+		}
+	}
+};
+
+static Registry registry;
+
+ThreadBuffer &getThreadBuffer()
+{
+	static thread_local ThreadBuffer *buffer = registry.add();
+	return *buffer;
+}
+
+} // namespace tracing
+
+#endif
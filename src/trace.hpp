@@ -0,0 +1,76 @@
+#pragma once
+
+// Zone and instant markers written as Chrome trace events (open in Perfetto or
+// chrome://tracing). Build with `make TRACE=1`; otherwise the macros compile to
+// nothing. Each thread records into its own ring of the latest events, which is
+// written to $GOODSHEPERD_TRACE_JSON (default GoodSheperd-trace.json) when the
+// plugin is unloaded.
+
+#ifdef GOODSHEPERD_TRACE
+
+#include <atomic>
+#include <cstdint>
+
+namespace tracing
+{
+
+struct Event
+{
+	const char *name;
+	uint64_t start;
+	/** Zero for instant events */
+	uint64_t duration;
+};
+
+struct ThreadBuffer
+{
+	static const uint32_t SIZE = 1 << 16;
+	Event events[SIZE];
+	std::atomic<uint32_t> count{0};
+	int threadId = 0;
+
+	void record(const char *name, uint64_t start, uint64_t duration)
+	{
+		uint32_t index = count.load(std::memory_order_relaxed);
+		events[index & (SIZE - 1)] = {name, start, duration};
+		count.store(index + 1, std::memory_order_release);
+	}
+};
+
+/** Nanoseconds since the first traced event */
+uint64_t now();
+/** The calling thread's buffer, registered on first use */
+ThreadBuffer &getThreadBuffer();
+
+struct Zone
+{
+	const char *name;
+	uint64_t start;
+
+	explicit Zone(const char *name) : name(name), start(now()) {}
+
+	~Zone()
+	{
+		uint64_t end = now();
+		getThreadBuffer().record(name, start, end > start ? end - start : 1);
+	}
+};
+
+inline void instant(const char *name)
+{
+	getThreadBuffer().record(name, now(), 0);
+}
+
+} // namespace tracing
+
+#define GS_TRACE_CONCAT_(a, b) a##b
+#define GS_TRACE_CONCAT(a, b) GS_TRACE_CONCAT_(a, b)
+#define GS_TRACE_ZONE(name) tracing::Zone GS_TRACE_CONCAT(gsTraceZone, __LINE__)(name)
+#define GS_TRACE_INSTANT(name) tracing::instant(name)
+
+#else
+
+#define GS_TRACE_ZONE(name) ((void)0)
+#define GS_TRACE_INSTANT(name) ((void)0)
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "plugin.hpp"
+
+// Seqtrol publishes its transport over the expander bus instead of cables.
+// It walks the unbroken row of transport modules on its right and writes the
+// message into the left expander of each one, so the whole row receives it
+// in the same engine frame, no matter how far it is from Seqtrol.
+
+struct TransportMessage
+{
+	/** Engine frame the message was written in */
+	int64_t frame = -1;
+	bool running = false;
+	/** Level of Seqtrol's reset output */
+	bool reset = false;
+	bool resetRise = false;
+	/** Level of Seqtrol's divided clock output */
+	bool clock = false;
+	bool clockRise = false;
+	/** MIDI clock ticks since the last Start */
+	int songPosition = 0;
+};
+
+/** Modules that take the transport when their own clock is not patched */
+inline bool isTransportModel(Model *model)
+{
+	return model == modelStable16 || model == modelStable4x16 || model == modelStable8x32 || model == modelStable16x64 || model == modelSEQ3st || model == modelSwitch1;
+}
+
+/** The receiving side, owns the double buffer of the module's left expander */
+struct TransportReceiver
+{
+	TransportMessage messages[2];
+
+	void attach(Module *module)
+	{
+		module->leftExpander.producerMessage = &messages[0];
+		module->leftExpander.consumerMessage = &messages[1];
+	}
+
+	/** The transport for this frame, nullptr if no Seqtrol wrote one in the last frame */
+	const TransportMessage *read(Module *module, const Module::ProcessArgs &args) const
+	{
+		const TransportMessage *message = (const TransportMessage *)module->leftExpander.consumerMessage;
+		return message->frame == args.frame - 1 ? message : nullptr;
+	}
+};
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""Runs stress patches in headless Rack and records CPU time to CSV.
+
+Build the plugin with `make PROFILE=1` first, so every module records the
+time spent in process(). For each model, instance count, engine thread count
+and sample rate this script
+
+1. writes a stress patch with tools/stress_patch.py,
+2. starts `Rack -h` with a scratch user folder holding the thread count and
+   sample rate, and with this plugin linked into it,
+3. lets the engine run for --seconds, then presses Enter to quit Rack,
+4. appends one CSV row per profiled model.
+
+    tools/bench_headless.py --rack ~/Rack2Free/Rack --plugin . \\
+        --models Stable16,Stall --instances 1,16,64 --threads 1,2,4 \\
+        --sample-rates 48000,96000 -o scaling.csv
+
+With --idle the sources are stopped, so `ns_per_call` is the cost of one idle
+sample:
+
+    tools/bench_headless.py --rack ~/Rack2Free/Rack --plugin . --idle \\
+        --models Hurdle,Switch1,Stall --instances 64 --threads 1 -o idle.csv
+
+Columns: model, instances, threads, sample_rate, profiled_model, calls,
+process_ns, ns_per_call, load. `load` is the share of one core the profiled
+model needs to keep up in real time. `rack_cpu_s` is the user+system time of
+the whole Rack process, including start-up.
+"""
+
+import argparse
+import csv
+import json
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import stress_patch  # noqa: E402
+
+
+def plugins_folder_names():
+    system = {"Linux": "lin", "Darwin": "mac", "Windows": "win"}.get(platform.system(), "lin")
+    cpu = "arm64" if platform.machine().lower() in ("arm64", "aarch64") else "x64"
+    # Rack before 2.4 uses the plain name
+    return ["plugins", "plugins-%s-%s" % (system, cpu)]
+
+
+def make_user_folder(root, plugin_dirs, threads, sample_rate):
+    user = os.path.join(root, "user")
+    os.makedirs(user)
+    with open(os.path.join(user, "settings.json"), "w") as f:
+        json.dump({"threadCount": threads, "sampleRate": sample_rate, "autosaveInterval": 0}, f)
+    for name in plugins_folder_names():
+        folder = os.path.join(user, name)
+        os.makedirs(folder)
+        for plugin_dir in plugin_dirs:
+            plugin_dir = os.path.abspath(plugin_dir)
+            os.symlink(plugin_dir, os.path.join(folder, os.path.basename(plugin_dir)))
+    return user
+
+
+def read_profile(path):
+    rows = []
+    if not os.path.exists(path):
+        return rows
+    with open(path) as f:
+        for line in f:
+            name, calls, nanoseconds = line.strip().split(",")
+            rows.append((name, int(calls), int(nanoseconds)))
+    return rows
+
+
+def run(args, model, instances, threads, sample_rate):
+    root = tempfile.mkdtemp(prefix="gs-bench-")
+    try:
+        user = make_user_folder(root, [args.plugin] + args.extra_plugin, threads, sample_rate)
+        patch_path = os.path.join(root, "stress.vcv")
+        with open(patch_path, "w") as f:
+            json.dump(stress_patch.build(model, instances, args.poly, idle=args.idle).to_json(), f)
+
+        profile_path = os.path.join(root, "profile.csv")
+        env = dict(os.environ, GOODSHEPERD_PROFILE_CSV=profile_path)
+        process = subprocess.Popen([args.rack, "-h", "-u", user, patch_path], stdin=subprocess.PIPE,
+                                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, env=env)
+        time.sleep(args.seconds)
+        process.stdin.write(b"\n")
+        process.stdin.flush()
+        _, status, usage = os.wait4(process.pid, 0)
+        process.returncode = status
+        rack_cpu = usage.ru_utime + usage.ru_stime
+
+        # Sources are counted under their own model, one pair per 16 instances
+        groups = (instances + stress_patch.GROUP_SIZE - 1) // stress_patch.GROUP_SIZE
+        counts = {model: instances}
+        counts["Stable16"] = counts.get("Stable16", 0) + groups
+        counts["SEQ3st"] = counts.get("SEQ3st", 0) + groups
+
+        results = []
+        for name, calls, nanoseconds in read_profile(profile_path):
+            audio_seconds = calls / float(counts.get(name, 1) * sample_rate)
+            results.append({
+                "model": model,
+                "instances": instances,
+                "threads": threads,
+                "sample_rate": sample_rate,
+                "rack_cpu_s": "%.3f" % rack_cpu,
+                "profiled_model": name,
+                "calls": calls,
+                "process_ns": nanoseconds,
+                "ns_per_call": "%.1f" % (nanoseconds / float(calls)) if calls else "",
+                "load": "%.4f" % (nanoseconds * 1e-9 / audio_seconds) if calls else "",
+            })
+        return results
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+
+def int_list(text):
+    return [int(x) for x in text.split(",") if x]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rack", required=True, help="Rack executable")
+    parser.add_argument("--plugin", required=True, help="GoodSheperd plugin folder, built with PROFILE=1")
+    parser.add_argument("--extra-plugin", action="append", default=[], help="further plugin folders, e.g. Fundamental for --poly")
+    parser.add_argument("--models", default="Stable16,SEQ3st,Stall,Flock,Hurdle,Hurdle8,Switch1,Switch16,Seqtrol")
+    parser.add_argument("--instances", type=int_list, default=[1, 16, 64])
+    parser.add_argument("--threads", type=int_list, default=[1, 2, 4])
+    parser.add_argument("--sample-rates", type=int_list, default=[48000])
+    parser.add_argument("--seconds", type=float, default=10.0)
+    parser.add_argument("--poly", action="store_true")
+    parser.add_argument("--idle", action="store_true", help="stop the sources to measure idle instances")
+    parser.add_argument("-o", "--output", default="bench.csv")
+    args = parser.parse_args()
+
+    fields = ["model", "instances", "threads", "sample_rate", "rack_cpu_s", "profiled_model", "calls", "process_ns", "ns_per_call", "load"]
+    with open(args.output, "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=fields)
+        writer.writeheader()
+        for model in args.models.split(","):
+            for instances in args.instances:
+                for threads in args.threads:
+                    for sample_rate in args.sample_rates:
+                        print("%s x%d, %d threads, %d Hz" % (model, instances, threads, sample_rate), file=sys.stderr)
+                        for row in run(args, model, instances, threads, sample_rate):
+                            writer.writerow(row)
+                        f.flush()
+
+
+if __name__ == "__main__":
+    main()
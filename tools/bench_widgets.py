@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""Measures how long the module widgets take to construct.
+
+Build the plugin with `make PROFILE=1` first. Every ModuleWidget constructor
+then appends its name, whether it is a browser preview (no module), the
+construction time and the number of widgets it created to
+$GOODSHEPERD_WIDGET_CSV. For each model and instance count this script
+
+1. writes a stress patch with tools/stress_patch.py,
+2. starts Rack with the patch, a scratch user folder and this plugin,
+3. waits until all instances are built, plus --seconds, then stops Rack,
+4. appends one CSV row per constructed widget type.
+
+    tools/bench_widgets.py --rack ~/Rack2Free/Rack --plugin . \\
+        --models Stable16,Stable16x64,SEQ3st --instances 1,16 -o widgets.csv
+
+Widgets are only built with a window, so this needs a display, unlike
+tools/bench_headless.py. Open the module browser while Rack is running to
+also record the previews, they show up with preview=1.
+
+Columns: model, instances, widget, preview, constructions, mean_us, max_us,
+widgets. The sources of the stress patch (Stable16 and SEQ3st) are listed
+under their own names.
+"""
+
+import argparse
+import csv
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import bench_headless  # noqa: E402
+import stress_patch  # noqa: E402
+
+
+def read_widgets(path):
+    rows = []
+    if not os.path.exists(path):
+        return rows
+    with open(path) as f:
+        for line in f:
+            name, preview, nanoseconds, widgets = line.strip().split(",")
+            rows.append((name, int(preview), int(nanoseconds), int(widgets)))
+    return rows
+
+
+def run(args, model, instances):
+    root = tempfile.mkdtemp(prefix="gs-widgets-")
+    try:
+        user = bench_headless.make_user_folder(root, [args.plugin], 1, 48000)
+        patch = stress_patch.build(model, instances).to_json()
+        patch_path = os.path.join(root, "stress.vcv")
+        with open(patch_path, "w") as f:
+            json.dump(patch, f)
+
+        csv_path = os.path.join(root, "widgets.csv")
+        env = dict(os.environ, GOODSHEPERD_WIDGET_CSV=csv_path)
+        process = subprocess.Popen([args.rack, "-u", user, patch_path],
+                                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, env=env)
+        deadline = time.time() + args.timeout
+        while len(read_widgets(csv_path)) < len(patch["modules"]) and time.time() < deadline:
+            time.sleep(0.2)
+        time.sleep(args.seconds)
+        process.terminate()
+        process.wait()
+
+        groups = {}
+        for name, preview, nanoseconds, widgets in read_widgets(csv_path):
+            groups.setdefault((name, preview), []).append((nanoseconds, widgets))
+
+        results = []
+        for (name, preview), samples in sorted(groups.items()):
+            times = [t for t, _ in samples]
+            results.append({
+                "model": model,
+                "instances": instances,
+                "widget": name,
+                "preview": preview,
+                "constructions": len(samples),
+                "mean_us": "%.1f" % (sum(times) / 1000.0 / len(times)),
+                "max_us": "%.1f" % (max(times) / 1000.0),
+                "widgets": samples[-1][1],
+            })
+        return results
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rack", required=True, help="Rack executable")
+    parser.add_argument("--plugin", required=True, help="GoodSheperd plugin folder, built with PROFILE=1")
+    parser.add_argument("--models", default="Stable16,Stable4x16,Stable8x32,Stable16x64,SEQ3st,Stall,Flock,Hurdle,Hurdle8,Switch1,Switch16,Seqtrol")
+    parser.add_argument("--instances", type=bench_headless.int_list, default=[1, 16])
+    parser.add_argument("--seconds", type=float, default=2.0, help="time to stay open after the patch is built")
+    parser.add_argument("--timeout", type=float, default=60.0, help="longest wait for the patch to be built")
+    parser.add_argument("-o", "--output", default="widgets.csv")
+    args = parser.parse_args()
+
+    fields = ["model", "instances", "widget", "preview", "constructions", "mean_us", "max_us", "widgets"]
+    with open(args.output, "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=fields)
+        writer.writeheader()
+        for model in args.models.split(","):
+            for instances in args.instances:
+                print("%s x%d" % (model, instances), file=sys.stderr)
+                for row in run(args, model, instances):
+                    writer.writerow(row)
+                f.flush()
+
+
+if __name__ == "__main__":
+    main()
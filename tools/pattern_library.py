@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+"""Builds and lists GoodSheperd pattern libraries (.gspl).
+
+    tools/pattern_library.py build grooves/*.vcv --tag groove -o patterns.gspl
+    tools/pattern_library.py list patterns.gspl
+
+build collects the grids of every Stable16 family module and the steps of
+every SEQ3st in the given patches. Each pattern is named after its patch and
+module id and gets the tags given with --tag. Patches are Rack 2 .vcv
+archives, which need the zstd command on the PATH, or plain JSON as written by
+Rack 1 and tools/stress_patch.py.
+
+--merge keeps the patterns of an existing library, patterns with the same
+name are replaced. Rack reads the library from
+<Rack user folder>/GoodSheperd/patterns.gspl.
+
+The layout matches src/patternlibrary.hpp, keep both in sync.
+"""
+
+import argparse
+import io
+import json
+import os
+import struct
+import subprocess
+import sys
+import tarfile
+
+PLUGIN = "GoodSheperd"
+MAGIC = b"GSPL"
+VERSION = 1
+MAX_TAGS = 32
+PATTERN_GRID = 1
+PATTERN_ROWS = 2
+
+HEADER = struct.Struct("<4s7I")
+ENTRY = struct.Struct("<6I")
+GRID = {"Stable16": (8, 16), "Stable4x16": (4, 16), "Stable8x32": (8, 32), "Stable16x64": (16, 64)}
+SEQ3ST_STEPS_PARAM = 3
+SEQ3ST_MAX_STEPS = 64
+ZSTD_MAGIC = b"\x28\xb5\x2f\xfd"
+
+
+def grid_data(rows, cols, data):
+    steps = data.get("steps", [])
+    probabilities = data.get("probabilities", [])
+    out = struct.pack("<2I", rows, cols)
+    for y in range(rows):
+        word = 0
+        for x in range(cols):
+            i = y * cols + x
+            if i < len(steps) and steps[i]:
+                word |= 1 << x
+        out += struct.pack("<Q", word)
+    out += bytes(min(int(probabilities[i]), 100) if i < len(probabilities) else 100 for i in range(rows * cols))
+    return out + bytes(-len(out) % 8)
+
+
+def rows_data(module):
+    data = module.get("data", {})
+    params = {p["id"]: p["value"] for p in module.get("params", [])}
+    steps = max(1, min(int(round(params.get(SEQ3ST_STEPS_PARAM, 8))), SEQ3ST_MAX_STEPS))
+    gates = data.get("gates", [1] * SEQ3ST_MAX_STEPS)
+    rows = data.get("rows", [[0.0] * SEQ3ST_MAX_STEPS] * 3)
+    gate_bits = sum(1 << i for i in range(steps) if i < len(gates) and gates[i])
+    out = struct.pack("<2IQ", steps, 0, gate_bits)
+    for row in range(3):
+        values = rows[row] if row < len(rows) else []
+        out += struct.pack("<%df" % steps, *(float(values[i]) if i < len(values) else 0.0 for i in range(steps)))
+    return out
+
+
+def load_patch(path):
+    """The patch.json of a Rack 2 archive, or the file itself if it is plain JSON"""
+    with open(path, "rb") as f:
+        raw = f.read()
+    if not raw.startswith(ZSTD_MAGIC):
+        return json.loads(raw.decode("utf-8"))
+    try:
+        raw = subprocess.run(["zstd", "-d", "-c"], input=raw, stdout=subprocess.PIPE, check=True).stdout
+    except (OSError, subprocess.CalledProcessError) as e:
+        sys.exit("%s: cannot decompress, is zstd installed? (%s)" % (path, e))
+    with tarfile.open(fileobj=io.BytesIO(raw)) as archive:
+        for member in archive.getmembers():
+            if os.path.basename(member.name) == "patch.json":
+                return json.load(archive.extractfile(member))
+    sys.exit("%s: no patch.json in the archive" % path)
+
+
+def read_patch(path, tags):
+    patch = load_patch(path)
+    stem = os.path.splitext(os.path.basename(path))[0]
+    records = []
+    for module in patch.get("modules", []):
+        if module.get("plugin") != PLUGIN:
+            continue
+        name = "%s %d" % (stem, module.get("id", 0))
+        model = module.get("model")
+        if model in GRID:
+            rows, cols = GRID[model]
+            records.append((name, tags, PATTERN_GRID, grid_data(rows, cols, module.get("data", {}))))
+        elif model == "SEQ3st":
+            records.append((name, tags, PATTERN_ROWS, rows_data(module)))
+    return records
+
+
+def read_library(path):
+    with open(path, "rb") as f:
+        blob = f.read()
+    magic, version, count, tag_count, entries_offset, tags_offset, size, _ = HEADER.unpack_from(blob)
+    if magic != MAGIC or version != VERSION or size != len(blob):
+        raise SystemExit("%s is not a version %d pattern library" % (path, VERSION))
+
+    def string(offset):
+        return blob[offset:blob.index(b"\0", offset)].decode()
+
+    tag_names = [string(o) for o in struct.unpack_from("<%dI" % tag_count, blob, tags_offset)]
+    records = []
+    for i in range(count):
+        name_offset, tag_mask, kind, data_offset, data_size, _ = ENTRY.unpack_from(blob, entries_offset + i * ENTRY.size)
+        tags = [t for b, t in enumerate(tag_names) if (tag_mask >> b) & 1]
+        records.append((string(name_offset), tags, kind, blob[data_offset:data_offset + data_size]))
+    return records
+
+
+def write_library(path, records):
+    records = sorted(records, key=lambda r: r[0].encode())
+    tag_names = []
+    for _, tags, _, _ in records:
+        for tag in tags:
+            if tag not in tag_names and len(tag_names) < MAX_TAGS:
+                tag_names.append(tag)
+
+    entries_offset = HEADER.size
+    tags_offset = entries_offset + len(records) * ENTRY.size
+    blob = bytearray(tags_offset + len(tag_names) * 4)
+    tag_offsets = []
+    for tag in tag_names:
+        tag_offsets.append(len(blob))
+        blob += tag.encode() + b"\0"
+    name_offsets = []
+    for name, _, _, _ in records:
+        name_offsets.append(len(blob))
+        blob += name.encode() + b"\0"
+
+    entries = []
+    for (name, tags, kind, data), name_offset in zip(records, name_offsets):
+        blob += bytes(-len(blob) % 8)
+        tag_mask = sum(1 << tag_names.index(t) for t in tags if t in tag_names)
+        entries.append(ENTRY.pack(name_offset, tag_mask, kind, len(blob), len(data), 0))
+        blob += data
+    blob += bytes(-len(blob) % 8)
+
+    HEADER.pack_into(blob, 0, MAGIC, VERSION, len(records), len(tag_names), entries_offset, tags_offset, len(blob), 0)
+    blob[entries_offset:tags_offset] = b"".join(entries)
+    struct.pack_into("<%dI" % len(tag_offsets), blob, tags_offset, *tag_offsets)
+
+    with open(path + ".tmp", "wb") as f:
+        f.write(blob)
+    os.replace(path + ".tmp", path)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest="command", required=True)
+    build = commands.add_parser("build", help="collect patterns from patches")
+    build.add_argument("patches", nargs="+")
+    build.add_argument("-o", "--output", required=True, help="library file")
+    build.add_argument("--tag", action="append", default=[], help="tag for every pattern, repeatable")
+    build.add_argument("--merge", action="store_true", help="keep the patterns already in the library")
+    listing = commands.add_parser("list", help="print the patterns of a library")
+    listing.add_argument("library")
+    args = parser.parse_args()
+
+    if args.command == "list":
+        for name, tags, kind, data in read_library(args.library):
+            kind_name = {PATTERN_GRID: "grid", PATTERN_ROWS: "rows"}.get(kind, str(kind))
+            sys.stdout.write("%-32s %-5s %6d B  %s\n" % (name, kind_name, len(data), " ".join("#" + t for t in tags)))
+        return
+
+    records = {}
+    if args.merge and os.path.exists(args.output):
+        records = {r[0]: r for r in read_library(args.output)}
+    for path in args.patches:
+        for record in read_patch(path, args.tag):
+            records[record[0]] = record
+    write_library(args.output, list(records.values()))
+    sys.stderr.write("%d patterns in %s\n" % (len(records), args.output))
+
+
+if __name__ == "__main__":
+    main()
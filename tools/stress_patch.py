@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+"""Writes a Rack patch with N instances of one GoodSheperd model.
+
+Every 16 instances share a clock source (a running Stable16 with a random
+pattern) and a CV source (a running SEQ3st with random knobs), so the
+instances see realistic gates, clocks and CVs instead of silence.
+
+    tools/stress_patch.py Stable16 64 -o stable16-64.vcv
+    tools/stress_patch.py Stall 32 --poly -o stall-32.vcv
+
+--poly merges the SEQ3st rows into polyphonic cables through the Fundamental
+Merge module, which then has to be installed.
+
+--idle stops the sources, so every instance sees steady gates and DC. This
+measures what a module costs while nothing happens.
+
+The patch is written as plain JSON, which Rack 2 still loads.
+"""
+
+import argparse
+import json
+import random
+import sys
+
+PLUGIN = "GoodSheperd"
+VERSION = "2.0.0"
+
+# Module widths in HP and port ids, keep in sync with the enums in src/
+WIDTH = {
+    "Flock": 27,
+    "Hurdle": 3,
+    "Hurdle8": 10,
+    "SEQ3st": 27,
+    "Seqtrol": 4,
+    "Stable16": 42,
+    "Stable4x16": 42,
+    "Stable8x32": 64,
+    "Stable16x64": 90,
+    "Stall": 27,
+    "Switch1": 4,
+    "Switch16": 8,
+    "Merge": 5,
+}
+# Rows and steps of the Stable16 family
+GRID = {"Stable16": (8, 16), "Stable4x16": (4, 16), "Stable8x32": (8, 32), "Stable16x64": (16, 64)}
+STABLE16_ROW_OUTPUT = 1
+SEQ3ST_GATES_OUTPUT = 0
+SEQ3ST_ROW_OUTPUT = 1
+SEQ3ST_GATE_ROW_OUTPUT = 4
+MERGE_POLY_OUTPUT = 0
+
+RACK_WIDTH_HP = 200
+GROUP_SIZE = 16
+
+
+class Patch:
+    def __init__(self):
+        self.modules = []
+        self.cables = []
+        self.x = 0
+        self.y = 0
+
+    def add(self, model, params=None, data=None, plugin=PLUGIN):
+        width = WIDTH[model]
+        if self.x + width > RACK_WIDTH_HP:
+            self.x = 0
+            self.y += 1
+        module = {
+            "id": len(self.modules) + 1,
+            "plugin": plugin,
+            "model": model,
+            "version": VERSION if plugin == PLUGIN else "2.0.0",
+            "params": [{"id": i, "value": v} for i, v in sorted((params or {}).items())],
+            "pos": [self.x, self.y],
+        }
+        if data is not None:
+            module["data"] = data
+        self.modules.append(module)
+        self.x += width
+        return module["id"]
+
+    def connect(self, out_module, out_id, in_module, in_id):
+        self.cables.append({
+            "id": len(self.cables) + 1,
+            "outputModuleId": out_module,
+            "outputId": out_id,
+            "inputModuleId": in_module,
+            "inputId": in_id,
+            "color": "#c91847",
+        })
+
+    def to_json(self):
+        return {"version": "2.0.0", "modules": self.modules, "cables": self.cables}
+
+
+def add_sources(patch, poly, idle=False):
+    """Returns (clock module, CV module, poly CV module, poly gate module)."""
+    clock = patch.add("Stable16", params={0: 4.0}, data={
+        "running": not idle,
+        "steps": [random.random() < 0.4 for _ in range(128)],
+    })
+    # 16 Hz internal clock, random knobs on all three rows
+    cv_params = {0: 4.0, 3: 8.0}
+    for i in range(24):
+        cv_params[4 + i] = random.uniform(0.0, 10.0)
+    cv = patch.add("SEQ3st", params=cv_params, data={"running": not idle})
+
+    poly_cv = poly_gate = None
+    if poly:
+        poly_cv = patch.add("Merge", plugin="Fundamental")
+        poly_gate = patch.add("Merge", plugin="Fundamental")
+        for i in range(3):
+            patch.connect(cv, SEQ3ST_ROW_OUTPUT + i, poly_cv, i)
+            patch.connect(cv, SEQ3ST_GATE_ROW_OUTPUT + i, poly_gate, i)
+    return clock, cv, poly_cv, poly_gate
+
+
+def add_instance(patch, model, index, sources):
+    clock, cv, poly_cv, poly_gate = sources
+    row = index % 8
+
+    if model in GRID:
+        rows, cols = GRID[model]
+        target = patch.add(model, params={0: random.uniform(2.0, 5.0)}, data={
+            "running": True,
+            "steps": [random.random() < 0.4 for _ in range(rows * cols)],
+        })
+        patch.connect(clock, STABLE16_ROW_OUTPUT + row, target, 1)
+    elif model == "SEQ3st":
+        params = {3: 8.0}
+        for i in range(24):
+            params[4 + i] = random.uniform(0.0, 10.0)
+        target = patch.add(model, params=params, data={"running": True})
+        patch.connect(clock, STABLE16_ROW_OUTPUT + row, target, 1)
+    elif model == "Hurdle":
+        target = patch.add(model)
+        patch.connect(cv, SEQ3ST_ROW_OUTPUT + row % 3, target, 0)
+        patch.connect(clock, STABLE16_ROW_OUTPUT + row, target, 1)
+    elif model == "Hurdle8":
+        target = patch.add(model, data={"mode": index % 4, "maxLanes": 2, "routerLanes": 2 + index % 7})
+        for i in range(8):
+            patch.connect(cv, SEQ3ST_ROW_OUTPUT + i % 3, target, i)
+            patch.connect(clock, STABLE16_ROW_OUTPUT + i, target, 8 + i)
+    elif model == "Switch1":
+        target = patch.add(model)
+        patch.connect(clock, STABLE16_ROW_OUTPUT + row, target, 0)
+        patch.connect(clock, STABLE16_ROW_OUTPUT + (row + 1) % 8, target, 2)
+        patch.connect(cv, SEQ3ST_ROW_OUTPUT, target, 4)
+        patch.connect(cv, SEQ3ST_ROW_OUTPUT + 1, target, 5)
+    elif model == "Switch16":
+        target = patch.add(model, data={"fadeIndex": index % 7})
+        for i in range(16):
+            if i % 2:
+                patch.connect(cv, SEQ3ST_ROW_OUTPUT + i % 3, target, i)
+            else:
+                patch.connect(clock, STABLE16_ROW_OUTPUT + i % 8, target, i)
+        patch.connect(clock, STABLE16_ROW_OUTPUT + row, target, 16)
+        patch.connect(cv, SEQ3ST_ROW_OUTPUT + row % 3, target, 17)
+    elif model == "Stall":
+        target = patch.add(model)
+        if poly_cv:
+            patch.connect(poly_cv, MERGE_POLY_OUTPUT, target, 0)
+            patch.connect(poly_gate, MERGE_POLY_OUTPUT, target, 1)
+        else:
+            patch.connect(cv, SEQ3ST_ROW_OUTPUT + row % 3, target, 0)
+            patch.connect(cv, SEQ3ST_GATES_OUTPUT, target, 1)
+    elif model == "Flock":
+        target = patch.add(model, data={"polyphony": 4 + index % 13, "stealPolicy": index % 5})
+        for i in range(48):
+            patch.connect(clock, STABLE16_ROW_OUTPUT + i % 8, target, i)
+        if poly_gate:
+            patch.connect(poly_gate, MERGE_POLY_OUTPUT, target, 48)
+    elif model == "Seqtrol":
+        target = patch.add(model, data={"divisorIndex": index % 13})
+        patch.connect(clock, STABLE16_ROW_OUTPUT, target, 0)
+        patch.connect(clock, STABLE16_ROW_OUTPUT + row, target, 3)
+    else:
+        raise SystemExit("unknown model %s" % model)
+    return target
+
+
+def build(model, count, poly=False, seed=1, idle=False):
+    random.seed(seed)
+    patch = Patch()
+    sources = None
+    for i in range(count):
+        if i % GROUP_SIZE == 0:
+            sources = add_sources(patch, poly, idle)
+        add_instance(patch, model, i, sources)
+    return patch
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("model", choices=sorted(m for m in WIDTH if m != "Merge"))
+    parser.add_argument("count", type=int)
+    parser.add_argument("-o", "--output", help="patch file, default stdout")
+    parser.add_argument("--poly", action="store_true", help="feed polyphonic CVs through Fundamental Merge")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--idle", action="store_true", help="stop the sources, so all inputs hold steady")
+    args = parser.parse_args()
+
+    patch = json.dumps(build(args.model, args.count, args.poly, args.seed, args.idle).to_json(), indent=1)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(patch)
+    else:
+        sys.stdout.write(patch)
+
+
+if __name__ == "__main__":
+    main()